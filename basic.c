@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // memmem
 #include "./basic.h"
 
 #include <assert.h>
@@ -6,15 +7,17 @@
 #include <limits.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <sys/stat.h>
 
 // Globals
-_Thread_local size_t temp_allocated = 0;
+const char hex_chars[] = "0123456789abcdef";
 _Thread_local uint8_t temp_buffer[TEMP_BUFFER_CAP];
 
 size_t align(size_t size) {
@@ -23,20 +26,307 @@ size_t align(size_t size) {
   return size + (8 - size % 8);
 }
 
+// Temp Allocator
+// Starts in the static buffer and chains heap blocks of doubling size once
+// it is full. Blocks are kept across rewinds so steady state does not touch
+// malloc, a reset releases them when they grew past TEMP_RETAIN_MAX.
+
+_Thread_local TempBlock temp_first = {0};
+_Thread_local TempBlock *temp_current = NULL;
+_Thread_local size_t temp_offset = 0;
+_Thread_local size_t temp_base = 0; // Capacity of the blocks before current
+_Thread_local TempStats temp_stats = {0};
+
+void temp_init(void) {
+  temp_first.data = temp_buffer;
+  temp_first.capacity = TEMP_BUFFER_CAP;
+  temp_current = &temp_first;
+  temp_stats.capacity = TEMP_BUFFER_CAP;
+  temp_stats.blocks = 1;
+}
+
+TempBlock *temp_block_new(size_t capacity) {
+  TempBlock *block = malloc(sizeof(TempBlock) + capacity);
+  assert(block != NULL);
+  block->next = NULL;
+  block->capacity = capacity;
+  block->data = (uint8_t *)(block + 1);
+
+  temp_stats.capacity += capacity;
+  temp_stats.blocks += 1;
+  return block;
+}
+
 void *talloc(size_t n) {
-  size_t size = align(n);
-  assert(size <= TEMP_BUFFER_CAP);
+  if (temp_current == NULL) {
+    temp_init();
+  }
 
-  if (temp_allocated + size >= TEMP_BUFFER_CAP) {
-    temp_allocated = 0;
+  const size_t size = align(n);
+  while (temp_offset + size > temp_current->capacity) {
+    if (temp_current->next == NULL) {
+      const size_t capacity = temp_current->capacity * 2;
+      temp_current->next = temp_block_new((capacity > size) ? capacity : size);
+      temp_stats.overflows += 1;
+    }
+    temp_base += temp_current->capacity;
+    temp_current = temp_current->next;
+    temp_offset = 0;
   }
 
-  void *ptr = &temp_buffer[temp_allocated];
-  temp_allocated += size;
+  void *ptr = &temp_current->data[temp_offset];
+  temp_offset += size;
+
+  const size_t allocated = temp_base + temp_offset;
+  if (allocated > temp_stats.high_water) {
+    temp_stats.high_water = allocated;
+  }
   return ptr;
 }
 
-void treset() { temp_allocated = 0; }
+TempMark tmark(void) {
+  if (temp_current == NULL) {
+    temp_init();
+  }
+  return (TempMark){temp_current, temp_offset, temp_base};
+}
+
+void trewind(TempMark mark) {
+  if (temp_current == NULL) {
+    return;
+  }
+
+#ifdef TEMP_DEBUG
+  // Catch use after rewind
+  TempBlock *block = mark.block;
+  size_t offset = mark.offset;
+  while (block != temp_current) {
+    memset(block->data + offset, TEMP_POISON, block->capacity - offset);
+    block = block->next;
+    offset = 0;
+  }
+  memset(block->data + offset, TEMP_POISON, temp_offset - offset);
+#endif
+
+  temp_current = mark.block;
+  temp_offset = mark.offset;
+  temp_base = mark.base;
+}
+
+void treset() {
+  if (temp_current == NULL) {
+    return;
+  }
+  trewind((TempMark){&temp_first, 0, 0});
+
+  if (temp_stats.capacity > TEMP_RETAIN_MAX) {
+    TempBlock *block = temp_first.next;
+    while (block != NULL) {
+      TempBlock *next = block->next;
+      free(block);
+      block = next;
+    }
+    temp_first.next = NULL;
+    temp_stats.capacity = TEMP_BUFFER_CAP;
+    temp_stats.blocks = 1;
+  }
+}
+
+TempStats tstats(void) {
+  TempStats stats = temp_stats;
+  stats.allocated = temp_base + temp_offset;
+  return stats;
+}
+
+// Arena Allocator
+
+_Thread_local Arena *current_arena = NULL;
+
+// Every allocation is prefixed with its size so it can be grown
+typedef struct {
+  size_t size;
+} ArenaHeader;
+
+#ifdef ARENA_DEBUG
+// Chunks of all arenas on all threads, only walked by assertions
+pthread_mutex_t arena_live_lock = PTHREAD_MUTEX_INITIALIZER;
+ArenaChunk *arena_live = NULL;
+#endif
+
+ArenaChunk *arena_chunk_new(size_t capacity) {
+  ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + capacity);
+  assert(chunk != NULL);
+  chunk->next = NULL;
+  chunk->capacity = capacity;
+  chunk->used = 0;
+
+#ifdef ARENA_DEBUG
+  pthread_mutex_lock(&arena_live_lock);
+  chunk->live_prev = NULL;
+  chunk->live_next = arena_live;
+  if (arena_live != NULL) {
+    arena_live->live_prev = chunk;
+  }
+  arena_live = chunk;
+  pthread_mutex_unlock(&arena_live_lock);
+#endif
+  return chunk;
+}
+
+void arena_chunk_free(ArenaChunk *chunk) {
+#ifdef ARENA_DEBUG
+  pthread_mutex_lock(&arena_live_lock);
+  if (chunk->live_prev != NULL) {
+    chunk->live_prev->live_next = chunk->live_next;
+  } else {
+    arena_live = chunk->live_next;
+  }
+  if (chunk->live_next != NULL) {
+    chunk->live_next->live_prev = chunk->live_prev;
+  }
+  pthread_mutex_unlock(&arena_live_lock);
+#endif
+  free(chunk);
+}
+
+#ifdef ARENA_DEBUG
+// Whether any arena holds ptr, heap pointers must not be arena memory
+bool arena_live_owns(const void *ptr) {
+  bool owned = false;
+  pthread_mutex_lock(&arena_live_lock);
+  for (ArenaChunk *chunk = arena_live; chunk != NULL && !owned; chunk = chunk->live_next) {
+    owned = (const char *)ptr >= chunk->data && (const char *)ptr < chunk->data + chunk->capacity;
+  }
+  pthread_mutex_unlock(&arena_live_lock);
+  return owned;
+}
+#endif
+
+void *arena_alloc(Arena *arena, size_t bytes) {
+  assert(arena != NULL);
+  const size_t size = align(sizeof(ArenaHeader) + bytes);
+
+  ArenaChunk *chunk = arena->current;
+  while (chunk != NULL && chunk->used + size > chunk->capacity) {
+    chunk = chunk->next; // Left over from before the last reset
+  }
+  if (chunk == NULL) {
+    const size_t capacity = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+    chunk = arena_chunk_new(capacity);
+    if (arena->current != NULL) {
+      chunk->next = arena->current->next;
+      arena->current->next = chunk;
+    } else {
+      arena->first = chunk;
+    }
+  }
+  arena->current = chunk;
+
+  ArenaHeader *header = (ArenaHeader *)(chunk->data + chunk->used);
+  header->size = size - sizeof(ArenaHeader);
+  chunk->used += size;
+  return header + 1;
+}
+
+void *arena_realloc(Arena *arena, void *ptr, size_t bytes) {
+  if (ptr == NULL) {
+    return arena_alloc(arena, bytes);
+  }
+
+  ArenaHeader *header = (ArenaHeader *)ptr - 1;
+  if (bytes <= header->size) {
+    return ptr;
+  }
+
+  // Last allocation of the chunk grows in place
+  ArenaChunk *chunk = arena->current;
+  const size_t extra = align(bytes) - header->size;
+  if ((char *)ptr + header->size == chunk->data + chunk->used &&
+      chunk->used + extra <= chunk->capacity) {
+    chunk->used += extra;
+    header->size += extra;
+    return ptr;
+  }
+
+  void *new_ptr = arena_alloc(arena, bytes);
+  memcpy(new_ptr, ptr, header->size);
+  return new_ptr;
+}
+
+bool arena_owns(const Arena *arena, const void *ptr) {
+  for (ArenaChunk *chunk = arena->first; chunk != NULL; chunk = chunk->next) {
+    if ((const char *)ptr >= chunk->data &&
+        (const char *)ptr < chunk->data + chunk->capacity)
+      return true;
+  }
+  return false;
+}
+
+void arena_reset(Arena *arena) {
+  assert(arena != NULL);
+  if (arena->first == NULL) {
+    return;
+  }
+
+  // Needed more than one chunk, keep a single one big enough next time
+  if (arena->first->next != NULL) {
+    size_t total = 0;
+    for (ArenaChunk *chunk = arena->first; chunk != NULL; chunk = chunk->next) {
+      total += chunk->capacity;
+    }
+    arena_free(arena);
+    arena->first = arena_chunk_new((total > ARENA_RETAIN_MAX) ? ARENA_CHUNK_SIZE : total);
+  }
+
+  arena->first->used = 0;
+  arena->current = arena->first;
+}
+
+void arena_free(Arena *arena) {
+  assert(arena != NULL);
+  ArenaChunk *chunk = arena->first;
+  while (chunk != NULL) {
+    ArenaChunk *next = chunk->next;
+    arena_chunk_free(chunk);
+    chunk = next;
+  }
+  arena->first = NULL;
+  arena->current = NULL;
+}
+
+Arena *arena_set_current(Arena *arena) {
+  Arena *previous = current_arena;
+  current_arena = arena;
+  return previous;
+}
+
+void *mem_alloc(size_t bytes) {
+  if (current_arena != NULL) {
+    return arena_alloc(current_arena, bytes);
+  }
+  return malloc(bytes);
+}
+
+void *mem_realloc(void *ptr, size_t bytes) {
+  if (current_arena != NULL && (ptr == NULL || arena_owns(current_arena, ptr))) {
+    return arena_realloc(current_arena, ptr, bytes);
+  }
+#ifdef ARENA_DEBUG
+  assert(ptr == NULL || !arena_live_owns(ptr)); // Another arena's memory
+#endif
+  return realloc(ptr, bytes);
+}
+
+void mem_free(void *ptr) {
+  // Arena memory goes away with the next reset
+  if (current_arena != NULL && arena_owns(current_arena, ptr)) {
+    return;
+  }
+#ifdef ARENA_DEBUG
+  assert(ptr == NULL || !arena_live_owns(ptr)); // Another arena's memory
+#endif
+  free(ptr);
+}
 
 // Error Handling
 
@@ -67,11 +357,21 @@ void try_(Error err, char *file, int line) {
 
 void sb_resize(StringBuilder *sb, size_t new_capacity) {
   sb->capacity = new_capacity;
-  void* ptr = realloc(sb->items, sb->capacity + 1);
+  void* ptr = MEM_REALLOC(sb->items, sb->capacity + 1);
   assert(ptr != NULL);
   sb->items = ptr;
 }
 
+// Grows geometrically so repeated pushes stay amortized O(1)
+void sb_reserve(StringBuilder *sb, size_t additional) {
+  if (sb->capacity < (sb->length + additional + 1)) {
+    size_t new_capacity = (sb->capacity < 16) ? 16 : sb->capacity * 2;
+    while (new_capacity < sb->length + additional + 1)
+      new_capacity *= 2;
+    sb_resize(sb, new_capacity);
+  }
+}
+
 void sb_free(const StringBuilder *sb) { array_free(sb); }
 
 String sb_to_sv(const StringBuilder *sb) {
@@ -83,9 +383,7 @@ String sb_to_sv(const StringBuilder *sb) {
 
 void sb_push_str(StringBuilder *sb, const char *str) {
   size_t item_len = strlen(str);
-  if (sb->capacity < (sb->length + item_len + 1)) {
-    sb_resize(sb, sb->capacity + item_len);
-  }
+  sb_reserve(sb, item_len);
 
   memcpy(sb->items + sb->length, str, item_len);
   sb->length += item_len;
@@ -93,9 +391,7 @@ void sb_push_str(StringBuilder *sb, const char *str) {
 }
 
 void sb_push_sv(StringBuilder *sb, String sv) {
-  if (sb->capacity < (sb->length + sv.length + 1)) {
-    sb_resize(sb, sb->capacity + sv.length);
-  }
+  sb_reserve(sb, sv.length);
 
   memcpy(sb->items + sb->length, sv.items, sv.length);
   sb->length += sv.length;
@@ -103,9 +399,7 @@ void sb_push_sv(StringBuilder *sb, String sv) {
 }
 
 void sb_push_char(StringBuilder *sb, char ch) {
-  if (sb->capacity < (sb->length + 2)) {
-    sb_resize(sb, sb->capacity + 1);
-  }
+  sb_reserve(sb, 1);
 
   sb->items[sb->length] = ch;
   sb->length += 1;
@@ -113,27 +407,22 @@ void sb_push_char(StringBuilder *sb, char ch) {
 }
 
 void sb_push_long(StringBuilder *sb, long l) {
-  if (l == 0) {
-    sb_push_char(sb, '0');
-    return;
-  }
-
-  const bool neg = l < 0;
-  if (neg)
-    l *= -1;
-
-  const long k = (long)((neg) ? log10((double)l) + 2 : log10((double)l) + 1);
-  sb_resize(sb, sb->capacity + k);
-
-  long j = k;
-  while (l != 0) {
-    sb->items[sb->length + j - 1] = (char)((l % 10) + '0');
-    l = l / 10;
-    j -= 1;
-  }
-
-  if (neg)
-    sb->items[sb->length] = '-';
+  // Digits are written backwards into a local buffer, unsigned so LONG_MIN
+  // can be negated
+  char buf[24];
+  char *end = buf + sizeof(buf);
+  char *p = end;
+  unsigned long u = (l < 0) ? -(unsigned long)l : (unsigned long)l;
+  do {
+    *--p = (char)('0' + (u % 10));
+    u /= 10;
+  } while (u != 0);
+  if (l < 0)
+    *--p = '-';
+
+  const size_t k = (size_t)(end - p);
+  sb_reserve(sb, k);
+  memcpy(sb->items + sb->length, p, k);
   sb->length += k;
   sb->items[sb->length] = 0;
 }
@@ -210,36 +499,33 @@ String sv_trim(String sv) { return sv_trim_left(sv_trim_right(sv)); }
 StringPair sv_split_delim(String sv, char delim) {
   StringPair result = {0};
 
-  size_t i = 0;
-  while (i < sv.length && sv.items[i] != delim)
-    i++;
+  const char *found = (sv.length > 0) ? memchr(sv.items, delim, sv.length) : NULL;
 
   // No delimiter found
-  if (i == sv.length) {
+  if (found == NULL) {
     result.first = sv;
     result.second = StringNil;
     return result;
   }
 
+  const size_t i = found - sv.items;
   result.first = SV2(sv.items, i);
   result.second = SV2(sv.items + i + 1, sv.length - i - 1);
 
   return result;
 }
 
+// memchr/memmem are vectorized by libc
 ssize_t sv_find(const String sv, const char *str) {
-  ssize_t i = 0;
   const size_t n = strlen(str);
+  if (n == 0 || sv.length < n)
+    return -1;
 
-  for (i = 0; i < sv.length; i++) {
-    if (sv.items[i] == str[0] && i + n <= sv.length) {
-      if (memcmp(str, &sv.items[i], n) == 0) {
-        return i;
-      }
-    }
-  }
+  const char *found = memmem(sv.items, sv.length, str, n);
+  if (found == NULL)
+    return -1;
 
-  return -1;
+  return found - sv.items;
 }
 
 StringPair sv_split_str(String sv, const char *str) {
@@ -252,17 +538,10 @@ StringPair sv_split_str(String sv, const char *str) {
     return result;
   }
 
-  size_t i = 0;
-  bool found = false;
-  for (i = 0; i + n <= sv.length; i++) {
-    if (memcmp(str, &sv.items[i], n) == 0) {
-      found = true;
-      break;
-    }
-  }
+  const ssize_t i = sv_find(sv, str);
 
   // No match found
-  if (!found) {
+  if (i == -1) {
     result.first = sv;
     result.second = StringNil;
     return result;
@@ -275,7 +554,7 @@ StringPair sv_split_str(String sv, const char *str) {
 }
 
 String sv_clone(String sv) {
-  char *str_copy = malloc(sv.length + 1);
+  char *str_copy = MEM_ALLOC(sv.length + 1);
   memcpy(str_copy, sv.items, sv.length);
   str_copy[sv.length] = 0;
   return SV2(str_copy, sv.length);
@@ -357,34 +636,61 @@ long sv_to_long(String sv, char **endptr) {
 int sv_to_int(String sv, char **endptr) { return (int)sv_to_long(sv, endptr); }
 
 String sv_escape(String sv) {
-  StringBuilder sb = {0};
+  // Sized up front so the result is a single allocation
+  size_t length = 0;
+  for (size_t i = 0; i < sv.length; i++) {
+    unsigned char ch = (unsigned char)sv.items[i];
+    switch (ch) {
+      case '\r':
+      case '\n':
+      case '\t':
+      case '\"':
+      case '\\':
+        length += 2;
+        break;
+      default:
+        length += (ch <= 0x1F) ? 6 : 1;
+    }
+  }
+
+  char *str = MEM_ALLOC(length + 1);
+  size_t j = 0;
   for (size_t i = 0; i < sv.length; i++) {
     unsigned char ch = (unsigned char)sv.items[i];
     switch (ch) {
       case '\r':
-        sb_push_str(&sb, "\\r");
+        str[j++] = '\\';
+        str[j++] = 'r';
         break;
       case '\n':
-        sb_push_str(&sb, "\\n");
+        str[j++] = '\\';
+        str[j++] = 'n';
         break;
       case '\t':
-        sb_push_str(&sb, "\\t");
+        str[j++] = '\\';
+        str[j++] = 't';
         break;
       case '\"':
-        sb_push_str(&sb, "\\\"");
+        str[j++] = '\\';
+        str[j++] = '"';
         break;
       case '\\':
-        sb_push_str(&sb, "\\\\");
+        str[j++] = '\\';
+        str[j++] = '\\';
         break;
       default:
         if (ch <= 0x1F) {
-          sb_push_sv(&sb, tprintf("\\u%04x", ch));
+          memcpy(str + j, "\\u00", 4);
+          str[j + 4] = hex_chars[ch >> 4];
+          str[j + 5] = hex_chars[ch & 0xF];
+          j += 6;
         } else {
-          sb_push_char(&sb, sv.items[i]);
+          str[j++] = sv.items[i];
         }
     }
   }
-  return sb_to_sv(&sb);
+  str[j] = 0;
+  return SV2(str, length);
 }
 
 /* Hash Table */
@@ -397,7 +703,7 @@ HashTable hash_table_init(size_t capacity, KeyEqFunc key_eq,
   HashTable v = {0};
 
   size_t sz = capacity * sizeof(HashTableEntry);
-  v.entries = (HashTableEntry *)malloc(sz);
+  v.entries = (HashTableEntry *)MEM_ALLOC(sz);
   assert(v.entries != NULL);
   v.capacity = capacity;
   v.key_eq = key_eq;
@@ -499,7 +805,7 @@ void hash_table_free(HashTable *v) {
   assert(v != NULL && "map is null");
 
   if (v->entries) {
-    free(v->entries);
+    MEM_FREE(v->entries);
     v->entries = NULL;
     v->capacity = 0;
   }
@@ -508,48 +814,48 @@ void hash_table_free(HashTable *v) {
 // Json Encoding & Decoding
 
 JsonValue *json_new_null(void) {
-  JsonValue *value = malloc(sizeof(JsonValue));
+  JsonValue *value = MEM_ALLOC(sizeof(JsonValue));
   value->type = JSON_NULL;
   return value;
 }
 
 JsonValue *json_new_bool(bool b) {
-  JsonValue *value = malloc(sizeof(JsonValue));
+  JsonValue *value = MEM_ALLOC(sizeof(JsonValue));
   value->type = JSON_BOOL;
   value->as.boolean = b;
   return value;
 }
 
 JsonValue *json_new_number(double n) {
-  JsonValue *value = malloc(sizeof(JsonValue));
+  JsonValue *value = MEM_ALLOC(sizeof(JsonValue));
   value->type = JSON_NUMBER;
   value->as.number = n;
   return value;
 }
 
 JsonValue *json_new_string(const String s) {
-  JsonValue *value = malloc(sizeof(JsonValue));
+  JsonValue *value = MEM_ALLOC(sizeof(JsonValue));
   value->type = JSON_STRING;
   value->as.string = sv_escape(s);
   return value;
 }
 
 JsonValue *json_new_cstr(char *s) {
-  JsonValue *value = malloc(sizeof(JsonValue));
+  JsonValue *value = MEM_ALLOC(sizeof(JsonValue));
   value->type = JSON_STRING;
   value->as.string = sv_clone(SV(s));
   return value;
 }
 
 JsonValue *json_new_array(void) {
-  JsonValue *value = malloc(sizeof(JsonValue));
+  JsonValue *value = MEM_ALLOC(sizeof(JsonValue));
   value->type = JSON_ARRAY;
   value->as.array = (JsonArray){0};
   return value;
 }
 
 JsonValue *json_new_object(void) {
-  JsonValue *value = malloc(sizeof(JsonValue));
+  JsonValue *value = MEM_ALLOC(sizeof(JsonValue));
   value->type = JSON_OBJECT;
   value->as.object = (JsonObject){0};
   return value;
@@ -810,6 +1116,12 @@ JsonString json_get_string(const JsonValue *json) {
   return json->as.string;
 }
 
+JsonBoolean json_get_bool(const JsonValue *json) {
+  assert(json != NULL);
+  assert(json->type == JSON_BOOL);
+  return json->as.boolean;
+}
+
 JsonValue *json_object_get(const JsonValue *json, String key) {
   assert(json != NULL);
   assert(json->type == JSON_OBJECT);
@@ -990,11 +1302,11 @@ void json_free(JsonValue *json) {
   case JSON_NULL:
   case JSON_BOOL:
   case JSON_NUMBER:
-    free(json);
+    MEM_FREE(json);
     break;
   case JSON_STRING:
-    free(json->as.string.items);
-    free(json);
+    MEM_FREE(json->as.string.items);
+    MEM_FREE(json);
     break;
 
   case JSON_ARRAY: {
@@ -1002,9 +1314,9 @@ void json_free(JsonValue *json) {
       for (int i = 0; i < json->as.array.length; i++) {
         json_free(json->as.array.items[i]);
       }
-      free(json->as.array.items);
+      MEM_FREE(json->as.array.items);
     }
-    free(json);
+    MEM_FREE(json);
     break;
   }
 
@@ -1012,12 +1324,12 @@ void json_free(JsonValue *json) {
     if (json->as.object.items) {
       for (int i = 0; i < json->as.object.length; i++) {
         if (json->as.object.items[i].key.items != NULL)
-          free(json->as.object.items[i].key.items);
+          MEM_FREE(json->as.object.items[i].key.items);
         json_free(json->as.object.items[i].value);
       }
-      free(json->as.object.items);
+      MEM_FREE(json->as.object.items);
     }
-    free(json);
+    MEM_FREE(json);
     break;
   }
   }
@@ -1075,7 +1387,6 @@ Error write_entire_file(const char *path, String sv) {
 }
 
 #define HEX_CHARSET_LEN 16
-const char hex_chars[] = "0123456789abcdef";
 
 Error random_bytes(char* buf, size_t n) {
   assert(buf != NULL);
@@ -3,7 +3,9 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -13,6 +15,47 @@
 #define WARN(format, ...) fprintf(stderr, "WARN: " format "\n", ##__VA_ARGS__)
 #define ERROR(format, ...) fprintf(stderr, "ERROR: " format "\n", ##__VA_ARGS__)
 
+// Arena Allocator
+// Bump allocator over a chain of chunks, everything is released at once by
+// arena_reset. While an arena is current on a thread, new MEM_ALLOC and
+// MEM_REALLOC(NULL, ...) allocations come from it; pointers that were heap
+// allocated keep using the heap. Build with -DARENA_DEBUG to trap growing
+// or freeing memory of an arena that isn't current instead of handing it to
+// the heap, every chunk is then registered under a global lock.
+#define ARENA_CHUNK_SIZE (16 * 1024)
+#define ARENA_RETAIN_MAX (256 * 1024) // Largest chunk kept across resets
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+#ifdef ARENA_DEBUG
+  struct ArenaChunk *live_prev; // Every chunk of every arena, see arena_live_owns
+  struct ArenaChunk *live_next;
+#endif
+  size_t capacity;
+  size_t used;
+  char data[];
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk *first;
+  ArenaChunk *current;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t bytes);
+void *arena_realloc(Arena *arena, void *ptr, size_t bytes);
+bool arena_owns(const Arena *arena, const void *ptr);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+Arena *arena_set_current(Arena *arena); // Returns the previous one
+
+void *mem_alloc(size_t bytes);
+void *mem_realloc(void *ptr, size_t bytes);
+void mem_free(void *ptr);
+
+#define MEM_ALLOC(bytes) mem_alloc(bytes)
+#define MEM_REALLOC(ptr, bytes) mem_realloc(ptr, bytes)
+#define MEM_FREE(ptr) mem_free(ptr)
+
 #define PAIR(T1, T2)                                                           \
   struct {                                                                     \
     T1 first;                                                                  \
@@ -32,7 +75,7 @@
     if ((array)->capacity < (array)->length + 1) {                             \
       (array)->capacity =                                                      \
           ((array)->capacity == 0) ? ARRAY_INIT_CAP : (array)->capacity * 1.5; \
-      void* ptr = realloc(                                                     \
+      void* ptr = MEM_REALLOC(                                                 \
           (array)->items, (array)->capacity * sizeof(*(array)->items));        \
       assert(ptr != NULL);                                                     \
       (array)->items = ptr;                                                    \
@@ -50,13 +93,41 @@
 #define array_free(array)                                                      \
   do {                                                                         \
     if ((array)->capacity > 0)                                                 \
-      free((array)->items);                                                \
+      MEM_FREE((array)->items);                                                \
   } while (0)
 
 // Temp Allocator
+// Short lived allocations, released in bulk with trewind or treset.
+// Build with -DTEMP_DEBUG to poison rewound memory.
 #define TEMP_BUFFER_CAP (4 * 1024)
+#define TEMP_RETAIN_MAX (1024 * 1024) // Overflow kept across resets
+#define TEMP_POISON 0xA5
+
+typedef struct TempBlock {
+  struct TempBlock *next;
+  size_t capacity;
+  uint8_t *data;
+} TempBlock;
+
+typedef struct {
+  TempBlock *block;
+  size_t offset;
+  size_t base;
+} TempMark;
+
+typedef struct {
+  size_t allocated;  // Currently in use
+  size_t high_water; // Most ever in use at once
+  size_t capacity;   // Static buffer plus overflow blocks
+  size_t blocks;
+  size_t overflows; // Times a new overflow block was needed
+} TempStats;
+
 void *talloc(size_t bytes);
+TempMark tmark(void);
+void trewind(TempMark mark); // Releases everything allocated after mark
 void treset();
+TempStats tstats(void);
 
 // String
 typedef struct {
@@ -73,6 +144,7 @@ typedef struct {
 #define StringNil (String){0}
 
 void sb_resize(StringBuilder *sb, size_t new_capacity);
+void sb_reserve(StringBuilder *sb, size_t additional); // Room for additional bytes
 void sb_free(const StringBuilder *sb);
 
 void sb_push_str(StringBuilder *sb, const char *str);
@@ -100,7 +172,7 @@ typedef PAIR(String, String) StringPair;
 
 StringPair sv_split_delim(String sv, char delim);
 StringPair sv_split_str(String sv, const char *str);
-String sv_clone(String sv); // Clones the string on the heap
+String sv_clone(String sv); // Clones the string with MEM_ALLOC
 
 String tprintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
 String tvprintf(const char *format, va_list);
@@ -109,7 +181,7 @@ String tvprintf(const char *format, va_list);
 long sv_to_long(String sv, char **endptr);
 int sv_to_int(String sv, char **endptr);
 
-String sv_escape(String sv); // This heap allocates memory
+String sv_escape(String sv); // Allocates with MEM_ALLOC
 
 // Hash Table
 
@@ -204,6 +276,7 @@ JsonValue *json_new_object(void);
 Error json_decode(String sv, JsonValue **out);
 JsonNumber json_get_number(const JsonValue *json);
 JsonString json_get_string(const JsonValue *json);
+JsonBoolean json_get_bool(const JsonValue *json);
 
 JsonValue *json_object_get(const JsonValue *json, String key);
 JsonValue *json_get(const JsonValue *json, String key);
@@ -312,4 +385,184 @@ String random_id(void);
     if (out) *(out) = (pq)->arr.items[0]; \
   } while (0)
 
+// Concurrency
+#define CACHE_LINE_SIZE 64
+
+// Bounded lock-free multi producer multi consumer queue (Vyukov). Every
+// cell carries a sequence number telling producers and consumers whose
+// turn it is, so each side only contends on its own index. Capacity is a
+// power of two. A pop may find the queue empty while a producer that
+// claimed an earlier cell is still writing it.
+#define MPMC_QUEUE(T)                                                          \
+  struct {                                                                     \
+    struct {                                                                   \
+      atomic_size_t seq;                                                       \
+      T item;                                                                  \
+    } *cells;                                                                  \
+    size_t mask;                                                               \
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; /* Next push */             \
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; /* Next pop */              \
+  }
+
+// Cells come from malloc, shared between threads they outlive any arena
+#define mpmc_init(q, capacity)                                                 \
+  do {                                                                         \
+    size_t _cap = (capacity);                                                  \
+    assert(_cap > 0 && (_cap & (_cap - 1)) == 0);                              \
+    (q)->cells = malloc(_cap * sizeof(*(q)->cells));                           \
+    assert((q)->cells != NULL);                                                \
+    for (size_t _i = 0; _i < _cap; _i++)                                       \
+      atomic_init(&(q)->cells[_i].seq, _i);                                    \
+    (q)->mask = _cap - 1;                                                      \
+    atomic_init(&(q)->head, 0);                                                \
+    atomic_init(&(q)->tail, 0);                                                \
+  } while (0)
+
+#define mpmc_free(q) free((q)->cells)
+
+// Sets *ok to false when the queue is full
+#define mpmc_push(q, value, ok)                                                \
+  do {                                                                         \
+    size_t _pos = atomic_load_explicit(&(q)->head, memory_order_relaxed);      \
+    typeof(&(q)->cells[0]) _cell;                                              \
+    *(ok) = true;                                                              \
+    while (true) {                                                             \
+      _cell = &(q)->cells[_pos & (q)->mask];                                   \
+      const size_t _seq =                                                      \
+          atomic_load_explicit(&_cell->seq, memory_order_acquire);             \
+      const intptr_t _diff = (intptr_t)_seq - (intptr_t)_pos;                  \
+      if (_diff == 0) {                                                        \
+        if (atomic_compare_exchange_weak_explicit(&(q)->head, &_pos, _pos + 1, \
+                                                  memory_order_relaxed,        \
+                                                  memory_order_relaxed))       \
+          break;                                                               \
+      } else if (_diff < 0) {                                                  \
+        *(ok) = false;                                                         \
+        break;                                                                 \
+      } else {                                                                 \
+        _pos = atomic_load_explicit(&(q)->head, memory_order_relaxed);         \
+      }                                                                        \
+    }                                                                          \
+    if (*(ok)) {                                                               \
+      _cell->item = (value);                                                   \
+      atomic_store_explicit(&_cell->seq, _pos + 1, memory_order_release);      \
+    }                                                                          \
+  } while (0)
+
+// Sets *ok to false when the queue is empty
+#define mpmc_pop(q, out, ok)                                                   \
+  do {                                                                         \
+    size_t _pos = atomic_load_explicit(&(q)->tail, memory_order_relaxed);      \
+    typeof(&(q)->cells[0]) _cell;                                              \
+    *(ok) = true;                                                              \
+    while (true) {                                                             \
+      _cell = &(q)->cells[_pos & (q)->mask];                                   \
+      const size_t _seq =                                                      \
+          atomic_load_explicit(&_cell->seq, memory_order_acquire);             \
+      const intptr_t _diff = (intptr_t)_seq - (intptr_t)(_pos + 1);            \
+      if (_diff == 0) {                                                        \
+        if (atomic_compare_exchange_weak_explicit(&(q)->tail, &_pos, _pos + 1, \
+                                                  memory_order_relaxed,        \
+                                                  memory_order_relaxed))       \
+          break;                                                               \
+      } else if (_diff < 0) {                                                  \
+        *(ok) = false;                                                         \
+        break;                                                                 \
+      } else {                                                                 \
+        _pos = atomic_load_explicit(&(q)->tail, memory_order_relaxed);         \
+      }                                                                        \
+    }                                                                          \
+    if (*(ok)) {                                                               \
+      *(out) = _cell->item;                                                    \
+      atomic_store_explicit(&_cell->seq, _pos + (q)->mask + 1,                 \
+                            memory_order_release);                             \
+    }                                                                          \
+  } while (0)
+
+// Bounded Chase-Lev work stealing deque (in the C11 formulation of Le et
+// al.). The owning thread pushes and pops at the bottom without contention
+// unless a single item is left, any other thread steals from the top.
+// Capacity is a power of two, T is a pointer or an integer since slots are
+// read and written atomically.
+#define WSDEQUE(T)                                                             \
+  struct {                                                                     \
+    T *items;                                                                  \
+    long mask;                                                                 \
+    _Alignas(CACHE_LINE_SIZE) atomic_long top;    /* Thieves */               \
+    _Alignas(CACHE_LINE_SIZE) atomic_long bottom; /* Owner */                 \
+  }
+
+// Items come from malloc like the MPMC_QUEUE cells
+#define wsdeque_init(d, capacity)                                              \
+  do {                                                                         \
+    long _cap = (capacity);                                                    \
+    assert(_cap > 0 && (_cap & (_cap - 1)) == 0);                              \
+    (d)->items = malloc(_cap * sizeof(*(d)->items));                           \
+    assert((d)->items != NULL);                                                \
+    (d)->mask = _cap - 1;                                                      \
+    atomic_init(&(d)->top, 0);                                                 \
+    atomic_init(&(d)->bottom, 0);                                              \
+  } while (0)
+
+#define wsdeque_free(d) free((d)->items)
+
+// Owner only, sets *ok to false when the deque is full
+#define wsdeque_push(d, value, ok)                                             \
+  do {                                                                         \
+    const long _b = atomic_load_explicit(&(d)->bottom, memory_order_relaxed);  \
+    const long _t = atomic_load_explicit(&(d)->top, memory_order_acquire);     \
+    *(ok) = _b - _t <= (d)->mask;                                              \
+    if (*(ok)) {                                                               \
+      __atomic_store_n(&(d)->items[_b & (d)->mask], (value), __ATOMIC_RELAXED); \
+      atomic_thread_fence(memory_order_release);                               \
+      atomic_store_explicit(&(d)->bottom, _b + 1, memory_order_relaxed);       \
+    }                                                                          \
+  } while (0)
+
+// Owner only, newest first, sets *ok to false when the deque is empty
+#define wsdeque_pop(d, out, ok)                                                \
+  do {                                                                         \
+    const long _b =                                                            \
+        atomic_load_explicit(&(d)->bottom, memory_order_relaxed) - 1;          \
+    atomic_store_explicit(&(d)->bottom, _b, memory_order_relaxed);             \
+    atomic_thread_fence(memory_order_seq_cst);                                 \
+    long _t = atomic_load_explicit(&(d)->top, memory_order_relaxed);           \
+    *(ok) = _t <= _b;                                                          \
+    if (*(ok)) {                                                               \
+      typeof(*(d)->items) _item =                                              \
+          __atomic_load_n(&(d)->items[_b & (d)->mask], __ATOMIC_RELAXED);      \
+      if (_t == _b) {                                                          \
+        /* Last item, race the thieves for it */                               \
+        *(ok) = atomic_compare_exchange_strong_explicit(                       \
+            &(d)->top, &_t, _t + 1, memory_order_seq_cst,                      \
+            memory_order_relaxed);                                             \
+        atomic_store_explicit(&(d)->bottom, _b + 1, memory_order_relaxed);     \
+      }                                                                        \
+      if (*(ok))                                                               \
+        *(out) = _item;                                                        \
+    } else {                                                                   \
+      atomic_store_explicit(&(d)->bottom, _b + 1, memory_order_relaxed);       \
+    }                                                                          \
+  } while (0)
+
+// Any thread, oldest first. Sets *ok to false when the deque is empty or
+// another thread won the item, callers may retry. The slot is read before
+// the item is claimed, when the owner has wrapped around and is refilling
+// it meanwhile the claim fails and the stale value is dropped.
+#define wsdeque_steal(d, out, ok)                                              \
+  do {                                                                         \
+    long _t = atomic_load_explicit(&(d)->top, memory_order_acquire);           \
+    atomic_thread_fence(memory_order_seq_cst);                                 \
+    const long _b = atomic_load_explicit(&(d)->bottom, memory_order_acquire);  \
+    *(ok) = _t < _b;                                                           \
+    if (*(ok)) {                                                               \
+      typeof(*(d)->items) _item =                                              \
+          __atomic_load_n(&(d)->items[_t & (d)->mask], __ATOMIC_RELAXED);      \
+      *(ok) = atomic_compare_exchange_strong_explicit(                         \
+          &(d)->top, &_t, _t + 1, memory_order_seq_cst, memory_order_relaxed); \
+      if (*(ok))                                                               \
+        *(out) = _item;                                                        \
+    }                                                                          \
+  } while (0)
+
 #endif // BASIC_H
@@ -42,6 +42,12 @@ int config_get_int(String key, int default_value) {
   return (int)config_get_double(key, default_value);
 }
 
+bool config_get_bool(String key, bool default_value) {
+  JsonValue* value = json_get(config, key);
+  if (value == NULL) return default_value;
+  return json_get_bool(value);
+}
+
 void config_free(void) {
   json_free(config);
 }
@@ -7,6 +7,7 @@ Error config_load(const char *path);
 String config_get_string(String key, String default_value);
 double config_get_double(String key, int default_value);
 int config_get_int(String key, int default_value);
+bool config_get_bool(String key, bool default_value);
 void config_free(void);
 
 #endif
\ No newline at end of file
@@ -1,34 +1,82 @@
 #include "basic.h"
 #include "http.h"
 #include "config.h"
+#include "middleware.h"
+#include "pool.h"
+#include "router.h"
 
-HttpResponse http_listen_callback(const HttpRequest* request) {
-  if (sv_equal(SV("/echo"), request->path)) {
-    JsonValue* json = json_new_object();
-    json_object_set(json, SV("request_id"), json_new_string(request->request_id));
-    json_object_set(json, SV("proto"), json_new_string(request->proto));
-    json_object_set(json, SV("method"), json_new_string(request->method));
-    json_object_set(json, SV("path"), json_new_string(request->path));
-    json_object_set(json, SV("body"), json_new_string(request->body));
-
-    JsonValue* headers = json_new_object();
-    for (size_t i=0; i<request->headers.capacity; i++) {
-      const HashTableEntry entry = request->headers.entries[i];
-      if (entry.key != NULL) {
-        const HeaderValues* values = entry.value;
-        JsonValue* header_values = json_new_array();
-        for (size_t j = 0; j<values->length; j++) {
-          json_array_append(header_values, json_new_string(values->items[j]));
-        }
-        json_object_set(headers, *(String*)entry.key, header_values);
-      }
+HttpRouter router = {0};
+HttpPipeline pipeline = {0};
+HttpCorsOptions cors = {0};
+HttpPool* echo_pool = NULL;
+
+HttpResponse echo_handler(const HttpRequest* request, const HttpRouteParams* params) {
+  JsonValue* json = json_new_object();
+  json_object_set(json, SV("request_id"), json_new_string(request->request_id));
+  json_object_set(json, SV("proto"), json_new_string(request->proto));
+  json_object_set(json, SV("method"), json_new_string(request->method));
+  json_object_set(json, SV("path"), json_new_string(request->path));
+  json_object_set(json, SV("body"), json_new_string(request->body));
+
+  JsonValue* headers = json_new_object();
+  for (size_t i=0; i<request->headers.length; i++) {
+    const HttpHeader header = request->headers.items[i];
+    JsonValue* header_values = json_object_get(headers, header.key);
+    if (header_values == NULL) {
+      header_values = json_new_array();
+      json_object_set(headers, header.key, header_values);
     }
-    json_object_set(json, SV("headers"), headers);
+    json_array_append(header_values, json_new_string(header.value));
+  }
+  json_object_set(json, SV("headers"), headers);
+
+  JsonValue* route_params = json_new_object();
+  for (size_t i=0; i<params->length; i++) {
+    json_object_set(route_params, params->items[i].name, json_new_string(params->items[i].value));
+  }
+  json_object_set(json, SV("params"), route_params);
 
-    return http_json_response(200, json);
+  return http_json_response(200, json);
+}
+
+HttpResponse health_handler(const HttpRequest* request, const HttpRouteParams* params) {
+  return http_text_response(200, SV("ok"));
+}
+
+HttpResponse stats_handler(const HttpRequest* request, const HttpRouteParams* params) {
+  JsonValue* json = json_new_object();
+  const HttpLoadStats load = http_load_stats();
+  json_object_set(json, SV("connections"), json_new_number(load.connections));
+  json_object_set(json, SV("in_flight"), json_new_number(load.in_flight));
+  json_object_set(json, SV("shed"), json_new_number(load.shed));
+
+  if (echo_pool != NULL) {
+    const HttpPoolStats stats = http_pool_stats(echo_pool);
+    JsonValue* pool = json_new_object();
+    json_object_set(pool, SV("threads"), json_new_number(stats.threads));
+    json_object_set(pool, SV("queued"), json_new_number(stats.queued));
+    json_object_set(pool, SV("running"), json_new_number(stats.running));
+    json_object_set(pool, SV("queue_high_water"), json_new_number(stats.queue_high_water));
+    json_object_set(pool, SV("completed"), json_new_number(stats.completed));
+    json_object_set(pool, SV("rejected"), json_new_number(stats.rejected));
+    json_object_set(pool, SV("wait_us"), json_new_number(stats.wait_us));
+    json_object_set(pool, SV("run_us"), json_new_number(stats.run_us));
+    JsonValue* pools = json_new_object();
+    json_object_set(pools, stats.name, pool);
+    json_object_set(json, SV("pools"), pools);
   }
 
-  return http_status_response(404);
+  HttpResponse response = http_json_response(200, json);
+  response.no_store = true;
+  return response;
+}
+
+HttpResponse http_listen_callback(const HttpRequest* request) {
+  return http_pipeline_run(&pipeline, request);
+}
+
+void http_decorate_callback(const HttpRequest* request, HashTable* request_headers) {
+  http_pipeline_decorate(&pipeline, request, request_headers);
 }
 
 int main(int argc, char** argv) {
@@ -37,8 +85,53 @@ int main(int argc, char** argv) {
   HttpServer server = {0};
   HttpServerInitOptions options = http_server_init_defaults();
   options.port = config_get_int(SV("server.port"), 8080); 
+  options.workers = config_get_int(SV("server.workers"), options.workers);
+  options.shard_listeners = config_get_bool(SV("server.shard_listeners"), options.shard_listeners);
+  options.pin_workers = config_get_bool(SV("server.pin_workers"), options.pin_workers);
+  options.numa_aware = config_get_bool(SV("server.numa_aware"), options.numa_aware);
+  options.max_body_memory = (size_t)config_get_int(SV("server.max_body_memory"), (int)options.max_body_memory);
+  options.max_body_size = (size_t)config_get_int(SV("server.max_body_size"), (int)options.max_body_size);
+  options.body_spill_dir = config_get_string(SV("server.body_spill_dir"), StringNil);
+  options.idle_timeout_ms = config_get_int(SV("server.idle_timeout_ms"), (int)options.idle_timeout_ms);
+  options.header_timeout_ms = config_get_int(SV("server.header_timeout_ms"), (int)options.header_timeout_ms);
+  options.body_timeout_ms = config_get_int(SV("server.body_timeout_ms"), (int)options.body_timeout_ms);
+  options.max_connections = config_get_int(SV("server.max_connections"), options.max_connections);
+  options.max_in_flight = config_get_int(SV("server.max_in_flight"), options.max_in_flight);
+  options.retry_after = config_get_int(SV("server.retry_after"), options.retry_after);
+  if (sv_equal(config_get_string(SV("server.io_backend"), SV("epoll")), SV("io_uring"))) {
+    options.io_backend = HTTP_IO_URING;
+  }
 
   try(http_server_init_opts(&server, options));
+  // Echo builds and encodes a JSON tree per request, so it gets a pool of
+  // its own and can't hold up the I/O workers or the cheap routes
+  const int echo_threads = config_get_int(SV("pools.echo.threads"), 2);
+  if (echo_threads > 0) {
+    try(http_pool_new(SV("echo"), echo_threads, config_get_int(SV("pools.echo.max_queue"), 1024), &echo_pool));
+  }
+  try(http_router_add_pool(&router, SV("*"), SV("/echo"), echo_handler, echo_pool));
+  try(http_router_add_pool(&router, SV("GET"), SV("/echo/:name/*rest"), echo_handler, echo_pool));
+  try(http_router_add(&router, SV("GET"), SV("/health"), health_handler));
+  try(http_router_add(&router, SV("GET"), SV("/stats"), stats_handler));
+
+  http_pipeline_init(&pipeline, &router);
+  http_pipeline_use(&pipeline, http_middleware_request_id());
+  if (config_get_bool(SV("server.server_timing"), false)) {
+    http_pipeline_use(&pipeline, http_middleware_timing());
+  }
+  cors.origin = config_get_string(SV("server.cors_origin"), StringNil);
+  if (cors.origin.length > 0) {
+    cors.methods = SV("GET, HEAD, POST, PUT, DELETE, PATCH");
+    cors.headers = config_get_string(SV("server.cors_headers"), SV("Content-Type, Authorization"));
+    cors.max_age = config_get_int(SV("server.cors_max_age"), 600);
+    http_pipeline_use(&pipeline, http_middleware_cors(&cors));
+  }
+
+  String static_root = config_get_string(SV("server.static_root"), StringNil);
+  if (static_root.length > 0) {
+    http_server_static(&server, config_get_string(SV("server.static_prefix"), SV("/static")), static_root);
+  }
+  http_server_decorate(&server, http_decorate_callback);
   try(http_server_listen(&server, http_listen_callback));
   return 0;
 }
@@ -1,13 +1,31 @@
+#define _GNU_SOURCE // accept4
 #include "http.h"
 #include "basic.h"
+#include "uring.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
 // For hashtable
 bool header_key_eq(void *a, void *b) {
   String *sa = a;
@@ -31,14 +49,19 @@ HashTable http_headers_init(void) {
 
 void http_headers_set(HashTable *headers, String key, String value) {
   assert(headers != NULL);
-  String *key_ptr = malloc(sizeof(String));
+  if (headers->entries == NULL) {
+    *headers = http_headers_init();
+  }
+  String *key_ptr = MEM_ALLOC(sizeof(String));
   *key_ptr = key;
 
   HeaderValues *out;
   if (hash_table_get(headers, key_ptr, (void **)&out)) {
     array_append(out, value);
+    MEM_FREE(key_ptr);
   } else {
-    HeaderValues *values = malloc(sizeof(HeaderValues));
+    HeaderValues *values = MEM_ALLOC(sizeof(HeaderValues));
+    *values = (HeaderValues){0};
     array_append(values, value);
     hash_table_set(headers, key_ptr, values);
   }
@@ -47,6 +70,9 @@ void http_headers_set(HashTable *headers, String key, String value) {
 HeaderValues *http_headers_get(const HashTable *headers, String key) {
   assert(headers != NULL);
   assert(key.length > 0);
+  if (headers->entries == NULL) {
+    return NULL;
+  }
 
   void *value = NULL;
   if (hash_table_get(headers, &key, &value)) {
@@ -61,88 +87,263 @@ void http_headers_free(HashTable *headers) {
     for (size_t i = 0; i < headers->capacity; i++) {
       HashTableEntry entry = headers->entries[i];
       if (entry.key != NULL) {
-        free(entry.key);
-        free(entry.value);
+        MEM_FREE(entry.key);
+        array_free((HeaderValues *)entry.value);
+        MEM_FREE(entry.value);
       }
     }
   }
   hash_table_free(headers);
 }
 
+// Perfect hash over the well known header names, the multipliers were
+// searched offline so that every name lands in its own slot:
+//   (length + 4 * lower(first) + lower(last)) & 63
+#define HTTP_HEADER_HASH(key)                                                  \
+  (((key).length + 4 * ((key).items[0] | 0x20) +                               \
+    ((key).items[(key).length - 1] | 0x20)) & 63)
+
+const HttpHeaderId http_header_slots[64] = {
+  [0] = HTTP_HEADER_UPGRADE,
+  [1] = HTTP_HEADER_REFERER,
+  [2] = HTTP_HEADER_CONTENT_LENGTH,
+  [3] = HTTP_HEADER_CONTENT_ENCODING,
+  [4] = HTTP_HEADER_CONNECTION,
+  [5] = HTTP_HEADER_CACHE_CONTROL,
+  [8] = HTTP_HEADER_TRANSFER_ENCODING,
+  [14] = HTTP_HEADER_EXPECT,
+  [16] = HTTP_HEADER_X_REQUEST_ID,
+  [17] = HTTP_HEADER_IF_RANGE,
+  [18] = HTTP_HEADER_USER_AGENT,
+  [24] = HTTP_HEADER_HOST,
+  [25] = HTTP_HEADER_IF_NONE_MATCH,
+  [26] = HTTP_HEADER_IF_MODIFIED_SINCE,
+  [27] = HTTP_HEADER_KEEP_ALIVE,
+  [33] = HTTP_HEADER_X_FORWARDED_FOR,
+  [39] = HTTP_HEADER_PRAGMA,
+  [48] = HTTP_HEADER_ORIGIN,
+  [50] = HTTP_HEADER_RANGE,
+  [55] = HTTP_HEADER_COOKIE,
+  [56] = HTTP_HEADER_ACCEPT_LANGUAGE,
+  [57] = HTTP_HEADER_DATE,
+  [58] = HTTP_HEADER_ACCEPT_ENCODING,
+  [61] = HTTP_HEADER_CONTENT_TYPE,
+  [62] = HTTP_HEADER_ACCEPT,
+  [63] = HTTP_HEADER_AUTHORIZATION,
+};
+
+const String http_header_names[HTTP_HEADER_COUNT] = {
+  [HTTP_HEADER_UNKNOWN] = {0},
+  [HTTP_HEADER_HOST] = SV("Host"),
+  [HTTP_HEADER_CONTENT_LENGTH] = SV("Content-Length"),
+  [HTTP_HEADER_CONTENT_TYPE] = SV("Content-Type"),
+  [HTTP_HEADER_CONNECTION] = SV("Connection"),
+  [HTTP_HEADER_TRANSFER_ENCODING] = SV("Transfer-Encoding"),
+  [HTTP_HEADER_ACCEPT] = SV("Accept"),
+  [HTTP_HEADER_ACCEPT_ENCODING] = SV("Accept-Encoding"),
+  [HTTP_HEADER_ACCEPT_LANGUAGE] = SV("Accept-Language"),
+  [HTTP_HEADER_USER_AGENT] = SV("User-Agent"),
+  [HTTP_HEADER_COOKIE] = SV("Cookie"),
+  [HTTP_HEADER_AUTHORIZATION] = SV("Authorization"),
+  [HTTP_HEADER_CACHE_CONTROL] = SV("Cache-Control"),
+  [HTTP_HEADER_IF_NONE_MATCH] = SV("If-None-Match"),
+  [HTTP_HEADER_IF_MODIFIED_SINCE] = SV("If-Modified-Since"),
+  [HTTP_HEADER_IF_RANGE] = SV("If-Range"),
+  [HTTP_HEADER_RANGE] = SV("Range"),
+  [HTTP_HEADER_REFERER] = SV("Referer"),
+  [HTTP_HEADER_ORIGIN] = SV("Origin"),
+  [HTTP_HEADER_EXPECT] = SV("Expect"),
+  [HTTP_HEADER_UPGRADE] = SV("Upgrade"),
+  [HTTP_HEADER_CONTENT_ENCODING] = SV("Content-Encoding"),
+  [HTTP_HEADER_X_FORWARDED_FOR] = SV("X-Forwarded-For"),
+  [HTTP_HEADER_X_REQUEST_ID] = SV("X-Request-Id"),
+  [HTTP_HEADER_DATE] = SV("Date"),
+  [HTTP_HEADER_PRAGMA] = SV("Pragma"),
+  [HTTP_HEADER_KEEP_ALIVE] = SV("Keep-Alive"),
+};
+
+HttpHeaderId http_header_id(String key) {
+  if (key.length == 0)
+    return HTTP_HEADER_UNKNOWN;
+  const HttpHeaderId id = http_header_slots[HTTP_HEADER_HASH(key)];
+  if (id != HTTP_HEADER_UNKNOWN && sv_equal_ignore_case(http_header_names[id], key))
+    return id;
+  return HTTP_HEADER_UNKNOWN;
+}
+
+String http_header_name(HttpHeaderId id) {
+  assert(id < HTTP_HEADER_COUNT);
+  return http_header_names[id];
+}
+
+String http_request_known_header(const HttpRequest *request, HttpHeaderId id) {
+  assert(request != NULL);
+  assert(id > HTTP_HEADER_UNKNOWN && id < HTTP_HEADER_COUNT);
+  const unsigned char i = request->headers.known[id];
+  if (i == 0)
+    return StringNil;
+  return request->headers.items[i - 1].value;
+}
+
+void http_request_headers_index(HttpHeaders *headers) {
+  memset(headers->index, 0, sizeof(headers->index));
+  for (size_t i = 0; i < headers->length; i++) {
+    size_t slot = header_key_hash(HTTP_HEADER_INDEX_SIZE, &headers->items[i].key);
+    while (true) {
+      const unsigned char j = headers->index[slot];
+      if (j == 0) {
+        headers->index[slot] = i + 1;
+        break;
+      }
+      // Repeated key, the first line wins
+      if (sv_equal_ignore_case(headers->items[j - 1].key, headers->items[i].key)) {
+        break;
+      }
+      slot = (slot + 1) & (HTTP_HEADER_INDEX_SIZE - 1);
+    }
+  }
+  headers->indexed = true;
+}
+
+String http_request_header(const HttpRequest *request, String key) {
+  assert(request != NULL);
+  const HttpHeaderId id = http_header_id(key);
+  if (id != HTTP_HEADER_UNKNOWN) {
+    return http_request_known_header(request, id);
+  }
+
+  // The index is a lookup cache, building it doesn't change the headers
+  HttpHeaders *headers = (HttpHeaders *)&request->headers;
+
+  if (headers->length < HTTP_HEADER_INDEX_MIN) {
+    for (size_t i = 0; i < headers->length; i++) {
+      if (sv_equal_ignore_case(headers->items[i].key, key))
+        return headers->items[i].value;
+    }
+    return StringNil;
+  }
+
+  if (!headers->indexed) {
+    http_request_headers_index(headers);
+  }
+
+  size_t slot = header_key_hash(HTTP_HEADER_INDEX_SIZE, &key);
+  while (headers->index[slot] != 0) {
+    const HttpHeader *header = &headers->items[headers->index[slot] - 1];
+    if (sv_equal_ignore_case(header->key, key))
+      return header->value;
+    slot = (slot + 1) & (HTTP_HEADER_INDEX_SIZE - 1);
+  }
+  return StringNil;
+}
+
 HttpServerInitOptions http_server_init_defaults(void) {
   return (HttpServerInitOptions){
       .port = HTTP_DEFAULT_PORT,
       .backlog = HTTP_BACKLOG,
       .header_capacity = HTTP_HEADER_CAPACITY,
+      .workers = HTTP_DEFAULT_WORKERS,
+      .response_cache_size = HTTP_RESPONSE_CACHE_SIZE,
+      .max_body_memory = HTTP_MAX_BODY_MEMORY,
+      .max_body_size = HTTP_MAX_BODY_SIZE,
+      .idle_timeout_ms = HTTP_IDLE_TIMEOUT_MS,
+      .header_timeout_ms = HTTP_HEADER_TIMEOUT_MS,
+      .body_timeout_ms = HTTP_BODY_TIMEOUT_MS,
+      .max_connections = HTTP_MAX_CONNECTIONS,
+      .retry_after = HTTP_RETRY_AFTER,
   };
 }
 Error http_server_init(HttpServer *server) {
   return http_server_init_opts(server, http_server_init_defaults());
 }
 
-Error http_server_init_opts(HttpServer *server, HttpServerInitOptions opt) {
-  assert(server != NULL);
-
-  server->sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server->sock_fd < 0) {
+Error http_server_bind(int port, int *sock_fd, struct sockaddr_in *addr) {
+  *sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (*sock_fd < 0) {
     return errorf("socket failed: %s", strerror(errno));
   }
 
   int socket_options = 1;
 #ifdef SO_REUSEADDR
-  if (setsockopt(server->sock_fd, SOL_SOCKET, SO_REUSEADDR, &socket_options,
+  if (setsockopt(*sock_fd, SOL_SOCKET, SO_REUSEADDR, &socket_options,
                  sizeof(socket_options)) < 0) {
     return errorf("setsockopt failed: %s", strerror(errno));
   }
 #endif
 
 #ifdef SO_REUSEPORT
-  if (setsockopt(server->sock_fd, SOL_SOCKET, SO_REUSEPORT, &socket_options,
+  if (setsockopt(*sock_fd, SOL_SOCKET, SO_REUSEPORT, &socket_options,
                  sizeof(socket_options)) < 0) {
     return errorf("setsockopt failed: %s", strerror(errno));
   }
 #endif
 
-  server->addr.sin_family = AF_INET;
-  server->addr.sin_addr.s_addr = INADDR_ANY;
-  server->addr.sin_port = htons(opt.port);
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = INADDR_ANY;
+  addr->sin_port = htons(port);
 
-  if (bind(server->sock_fd, (struct sockaddr *)&server->addr,
-           sizeof(server->addr)) < 0) {
+  if (bind(*sock_fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
     return errorf("bind failed: %s", strerror(errno));
   }
 
   return ErrorNil;
 }
 
-#define CRLF "\r\n"
+// Descriptors kept free of connections for listeners, epoll, spill and
+// static files
+#define HTTP_RESERVED_FDS 128
+
+// Accepting past the descriptor limit fails with EMFILE, so the soft limit
+// is raised to fit the connection budget, or the budget is lowered to fit
+// the hard limit
+void http_fit_max_connections(HttpServerInitOptions *opt) {
+  struct rlimit limit;
+  if (opt->max_connections <= 0 || getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    return;
+  }
+  const rlim_t wanted = (rlim_t)opt->max_connections + HTTP_RESERVED_FDS;
+  if (limit.rlim_cur >= wanted) {
+    return;
+  }
+  limit.rlim_cur = (limit.rlim_max < wanted) ? limit.rlim_max : wanted;
+  if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    getrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (limit.rlim_cur < wanted) {
+    const rlim_t fit = (limit.rlim_cur > 2 * HTTP_RESERVED_FDS) ? limit.rlim_cur - HTTP_RESERVED_FDS : limit.rlim_cur / 2;
+    WARN("open file limit is %lu, lowering max connections from %d to %lu",
+         (unsigned long)limit.rlim_cur, opt->max_connections, (unsigned long)fit);
+    opt->max_connections = (int)fit;
+  }
+}
 
-void http_response_write(const int client_fd, const char *buffer, const size_t length) {
-  assert(buffer != NULL);
-  assert(length > 0);
+Error http_server_init_opts(HttpServer *server, HttpServerInitOptions opt) {
+  assert(server != NULL);
 
-  size_t total_written = 0;
-  while (total_written < length) {
-    const ssize_t n = write(client_fd, buffer + total_written, length - total_written);
-    if (n < 0) {
-      if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK) {
-        continue;
-      }
-      ERROR("write failed: %s", strerror(errno));
-      break;
-    }
-    if (n == 0) {
-      break;
-    }
-    total_written += n;
+  if (opt.workers <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opt.workers = (cpus > 0) ? (int)cpus : 1;
+  }
+#ifndef SO_REUSEPORT
+  if (opt.shard_listeners) {
+    return error("listener sharding requires SO_REUSEPORT");
   }
+#endif
+  http_fit_max_connections(&opt);
+  server->options = opt;
+
+  return http_server_bind(opt.port, &server->sock_fd, &server->addr);
 }
 
+#define CRLF "\r\n"
+
 typedef enum {
   HttpErrorNil,
+  HttpErrorIncomplete,
   HttpErrorEOF,
   HttpErrorConnectionReset,
   HttpErrorRead,
+  HttpErrorWrite,
   HttpErrorParse,
   HttpErrorUnknown,
 } HttpError;
@@ -151,12 +352,16 @@ String http_error_to_string(const HttpError err) {
   switch (err) {
   case HttpErrorNil:
     return SV("nil");
+  case HttpErrorIncomplete:
+    return SV("incomplete");
   case HttpErrorEOF:
     return SV("eof");
   case HttpErrorConnectionReset:
     return SV("connection closed");
   case HttpErrorRead:
     return SV("read error");
+  case HttpErrorWrite:
+    return SV("write error");
   case HttpErrorParse:
     return SV("parse error");
   default:
@@ -169,272 +374,3495 @@ String http_request_to_string(const HttpRequest request) {
     SV_Arg(request.method), SV_Arg(request.path), SV_Arg(request.proto));
 }
 
-HttpError http_parse_request(const int client, StringBuilder *sb,
-                             HttpRequest *request) {
-  assert(request != NULL);
+// Tokenizer scanners, runtime dispatched to AVX2 or SSE4.2 when the CPU has
+// them. Both return the index of the first byte that ends the run.
+typedef size_t (*HttpScanFunc)(const char *buf, size_t n);
+
+// tchar (RFC 9110) lookup, plus the nibble tables used by the AVX2 scanner:
+// a byte is a tchar when token_lo[low nibble] & token_hi[high nibble] != 0
+bool http_token_table[256];
+unsigned char http_token_lo[16];
+unsigned char http_token_hi[16];
+
+size_t http_scan_token_scalar(const char *buf, size_t n) {
+  size_t i = 0;
+  while (i < n && http_token_table[(unsigned char)buf[i]])
+    i++;
+  return i;
+}
 
-  ssize_t header_end;
-  char *buffer = talloc(HTTP_READ_BUFFER_SIZE); // Temp allocated buffer
+// Field values stop at control characters other than HTAB, e.g. CR and LF
+size_t http_scan_value_scalar(const char *buf, size_t n) {
+  size_t i = 0;
+  for (; i < n; i++) {
+    const unsigned char ch = buf[i];
+    if ((ch < 0x20 && ch != '\t') || ch == 0x7f)
+      break;
+  }
+  return i;
+}
 
-  while (true) {
-    const ssize_t n = read(client, buffer, HTTP_READ_BUFFER_SIZE);
-    if (n < 0) {
-      if (errno == ECONNRESET) {
-        return HttpErrorConnectionReset;
-      }
-      return HttpErrorRead;
-    }
-    if (n == 0) {
-      return HttpErrorEOF;
+#ifdef HTTP_SCAN_X86
+__attribute__((target("sse4.2")))
+size_t http_scan_token_sse42(const char *buf, size_t n) {
+  // Only 8 ranges fit, '{' to 0xff includes the tchars '|' and '~'
+  const char ranges[16] = {0x00, 0x20, '"', '"', '(', ')', ',', ',',
+                           '/', '/', ':', '@', '[', ']', '{', (char)0xff};
+  const __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+
+  size_t i = 0;
+  while (i + 16 <= n) {
+    const __m128i b = _mm_loadu_si128((const __m128i *)(buf + i));
+    const int idx = _mm_cmpestri(r, 16, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES);
+    if (idx == 16) {
+      i += 16;
+      continue;
     }
-    sb_push_sv(sb, SV2(buffer, n));
-    header_end = sv_find(sb_to_sv(sb), CRLF CRLF);
-    if (header_end != -1) {
-      break;
+    i += idx;
+    if (!http_token_table[(unsigned char)buf[i]])
+      return i;
+    i++;
+  }
+  return i + http_scan_token_scalar(buf + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+size_t http_scan_value_sse42(const char *buf, size_t n) {
+  const char ranges[16] = {0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f};
+  const __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i b = _mm_loadu_si128((const __m128i *)(buf + i));
+    const int idx = _mm_cmpestri(r, 6, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES);
+    if (idx != 16)
+      return i + idx;
+  }
+  return i + http_scan_value_scalar(buf + i, n - i);
+}
+
+__attribute__((target("avx2")))
+size_t http_scan_token_avx2(const char *buf, size_t n) {
+  const __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)http_token_lo));
+  const __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)http_token_hi));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i));
+    const __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(b, nibble));
+    const __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble));
+    const __m256i bad = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+    const unsigned mask = (unsigned)_mm256_movemask_epi8(bad);
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + http_scan_token_scalar(buf + i, n - i);
+}
+
+__attribute__((target("avx2")))
+size_t http_scan_value_avx2(const char *buf, size_t n) {
+  const __m256i ctl = _mm256_set1_epi8(0x1f);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i));
+    const __m256i is_ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(b, ctl), b);
+    const __m256i bad = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(b, tab), is_ctl),
+                                        _mm256_cmpeq_epi8(b, del));
+    const unsigned mask = (unsigned)_mm256_movemask_epi8(bad);
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + http_scan_value_scalar(buf + i, n - i);
+}
+#endif
+
+HttpScanFunc http_scan_token = http_scan_token_scalar;
+HttpScanFunc http_scan_value = http_scan_value_scalar;
+
+void http_scan_init_once(void) {
+  const char *specials = "!#$%&'*+-.^_`|~";
+  for (int ch = 1; ch < 128; ch++) {
+    if (isalnum(ch) || strchr(specials, ch) != NULL) {
+      http_token_table[ch] = true;
+      http_token_lo[ch & 0x0f] |= 1 << (ch >> 4);
     }
   }
+  for (int h = 0; h < 8; h++) {
+    http_token_hi[h] = 1 << h;
+  }
+
+#ifdef HTTP_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    http_scan_token = http_scan_token_avx2;
+    http_scan_value = http_scan_value_avx2;
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    http_scan_token = http_scan_token_sse42;
+    http_scan_value = http_scan_value_sse42;
+  }
+#endif
+}
+
+void http_scan_init(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, http_scan_init_once);
+}
+
+typedef struct {
+  size_t offset;
+  size_t length;
+} HttpSpan;
+
+typedef struct {
+  HttpSpan key;
+  HttpSpan value;
+  HttpHeaderId id;
+} HttpHeaderSpan;
+
+typedef enum {
+  HTTP_BODY_START,
+  HTTP_BODY_DATA,       // Content-Length body or chunk data
+  HTTP_BODY_CHUNK_SIZE, // Size line of the next chunk
+  HTTP_BODY_CHUNK_END,  // CRLF after chunk data
+  HTTP_BODY_TRAILER,    // Trailer fields after the last chunk, discarded
+  HTTP_BODY_DONE,
+} HttpBodyState;
+
+#define HTTP_CHUNK_LINE_MAX 1024 // Longer chunk size or trailer lines are rejected
+
+// Resumable request parser, every byte of the header block is scanned once
+// no matter how many reads it arrives in. Offsets are relative to the start
+// of the request so they stay valid when the buffer is reallocated or shifted.
+typedef struct {
+  size_t scanned;    // Bytes already tokenized
+  size_t line_start; // Start of the line being tokenized
+  size_t colon;      // Offset of ':' on the current header line, 0 until found
+  bool request_line_done;
+  HttpSpan method;
+  HttpSpan path;
+  HttpSpan proto;
+  bool headers_done;
+  size_t header_length; // Request line, headers and the blank line
+  size_t content_length;
+  bool content_length_set;
+  bool chunked;
+  bool continued;       // 100 Continue was sent
+
+  // The body is decoded in place, chunk data is moved down over the framing
+  // so the decoded bytes directly follow the header block
+  HttpBodyState body_state;
+  size_t chunk_left;   // Data left in the current chunk or Content-Length body
+  size_t body_scanned; // Raw body bytes consumed, framing included
+  size_t body_length;  // Decoded bytes still in the buffer
+
+  size_t header_count;
+  HttpHeaderSpan headers[HTTP_MAX_HEADERS]; // Must stay last, see reset
+} HttpParser;
+
+void http_parser_reset(HttpParser *parser) {
+  // Spans past header_count are never read
+  memset(parser, 0, offsetof(HttpParser, headers));
+}
+
+HttpSpan http_span(String raw, String sv) {
+  if (sv.length == 0)
+    return (HttpSpan){0};
+  return (HttpSpan){.offset = sv.items - raw.items, .length = sv.length};
+}
 
-  String request_str = sb_to_sv(sb);
+String http_span_sv(String raw, HttpSpan span) {
+  return SV2(raw.items + span.offset, span.length);
+}
 
-  // Parsing the request
-  StringPair p0 = sv_split_str(request_str, CRLF); // (status_line vs rest)
-  StringPair p1 = sv_split_delim(p0.first, ' ');   // (method vs rest)
-  StringPair p2 = sv_split_delim(p1.second, ' ');  // (path vs rest)
-  StringPair p3 = sv_split_delim(p2.second, ' ');  // (proto vs rest)
-  if (p0.first.length == 0 || p1.first.length == 0 || p2.first.length == 0) {
+HttpError http_parser_request_line(HttpParser *parser, String raw, String line) {
+  StringPair p1 = sv_split_delim(line, ' ');      // (method vs rest)
+  StringPair p2 = sv_split_delim(p1.second, ' '); // (path vs rest)
+  StringPair p3 = sv_split_delim(p2.second, ' '); // (proto vs rest)
+  if (line.length == 0 || p1.first.length == 0 || p2.first.length == 0) {
+    return HttpErrorParse;
+  }
+  if (http_scan_token(p1.first.items, p1.first.length) != p1.first.length) {
     return HttpErrorParse;
   }
 
-  request->request_id = random_id();
-  request->proto = p3.first;
-  request->method = p1.first;
-  request->path = p2.first;
-  request->headers = http_headers_init();
-
-  // Parsing the headers
-  size_t content_length = 0;
-  String sv = p0.second;
-  while (sv.length > 0) {
-    StringPair header_line_headers_pair = sv_split_str(sv, CRLF);        // header_line vs rest
-    StringPair header_pair = sv_split_delim(header_line_headers_pair.first, ':'); // header_key vs header_value
-
-    String key = sv_trim_left(header_pair.first);
-    String value = sv_trim_left(header_pair.second);
-    if (key.length == 0 || value.length == 0) {
-      break;
-    }
+  parser->method = http_span(raw, p1.first);
+  parser->path = http_span(raw, p2.first);
+  parser->proto = http_span(raw, p3.first);
+  parser->request_line_done = true;
+  return HttpErrorNil;
+}
 
-    if (sv_equal(key, SV("Content-Length"))) {
-      char* endptr = NULL;
-      content_length = sv_to_long(value, &endptr);
-      if (endptr != value.items + value.length) {
-        ERROR("invalid content length");
-        return  HttpErrorParse;
-      }
+// Digits only, no sign or list, and small enough to add to without wrapping
+bool http_parse_content_length(String value, size_t *length) {
+  if (value.length == 0) {
+    return false;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < value.length; i++) {
+    const char c = value.items[i];
+    if (c < '0' || c > '9' || n > (SIZE_MAX / 2 - (c - '0')) / 10) {
+      return false;
     }
-
-    http_headers_set(&request->headers, key, value);
-    sv = header_line_headers_pair.second;
+    n = n * 10 + (c - '0');
   }
+  *length = n;
+  return true;
+}
 
-  // Read body if not read yet
-  while (sb->length < (header_end + 4 + content_length)) {
-    size_t to_read = header_end + 4 + content_length - sb->length;
-    if (to_read > HTTP_READ_BUFFER_SIZE) {
-      to_read = HTTP_READ_BUFFER_SIZE;
+// Empty values are kept, "X-Foo:" is a header like any other
+HttpError http_parser_header(HttpParser *parser, String raw, String key, String value) {
+  const HttpHeaderId id = http_header_id(key);
+  if (id == HTTP_HEADER_CONTENT_LENGTH) {
+    size_t length;
+    if (!http_parse_content_length(value, &length)) {
+      ERROR("invalid content length");
+      return HttpErrorParse;
     }
-    ssize_t n = read(client, buffer, to_read);
-    if (n < 0) {
-      if (errno == ECONNRESET || errno == EPIPE) {
-        return HttpErrorConnectionReset;
-      }
-      return HttpErrorRead;
+    // Proxies may have picked a different one than us
+    if (parser->content_length_set && parser->content_length != length) {
+      ERROR("conflicting content lengths");
+      return HttpErrorParse;
     }
-    if (n == 0) {
-      return HttpErrorEOF;
+    parser->content_length = length;
+    parser->content_length_set = true;
+  }
+  if (id == HTTP_HEADER_TRANSFER_ENCODING) {
+    // Other codings can't be undone here, so the body length is unknown
+    if (!sv_equal_ignore_case(value, SV("chunked"))) {
+      ERROR("unsupported transfer encoding");
+      return HttpErrorParse;
     }
-    sb_push_sv(sb, SV2(buffer, n));
+    parser->chunked = true;
   }
-  request->body = SV2(sb->items + header_end + 4, content_length);
-  request->raw_request = sb_to_sv(sb);
 
-  return 0;
+  if (parser->header_count == HTTP_MAX_HEADERS) {
+    ERROR("too many headers");
+    return HttpErrorParse;
+  }
+  parser->headers[parser->header_count++] = (HttpHeaderSpan){http_span(raw, key), http_span(raw, value), id};
+  return HttpErrorNil;
 }
 
-String http_status_code_to_string(const int status_code) {
-  switch (status_code) {
-  case 200:
-    return SV("OK");
-  case 201:
-    return SV("Created");
-  case 204:
-    return SV("No Content");
-  case 301:
-    return SV("Moved Permanently");
-  case 400:
-    return SV("Bad Request");
-  case 404:
-    return SV("Not Found");
-  case 405:
-    return SV("Method Not Allowed");
-  case 500:
-    return SV("Internal Server Error");
-  default:
-    return SV("Unknown");
+// Finds the end of the current line from parser->scanned, validating the
+// bytes on the way as field value characters.
+HttpError http_parser_line_end(HttpParser *parser, String raw, size_t *line_end,
+                               size_t *next_line) {
+  const size_t pos = parser->scanned +
+      http_scan_value(raw.items + parser->scanned, raw.length - parser->scanned);
+  if (pos == raw.length) {
+    parser->scanned = pos;
+    return HttpErrorIncomplete;
   }
-}
 
-char *http_date(void) {
-  time_t t;
-  time(&t);
-  struct tm *tm = gmtime(&t);
-  static char buf[40];
-  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", tm);
-  return buf;
+  if (raw.items[pos] == '\n') {
+    *line_end = pos;
+    *next_line = pos + 1;
+    return HttpErrorNil;
+  }
+  if (raw.items[pos] == '\r') {
+    if (pos + 1 == raw.length) {
+      parser->scanned = pos;
+      return HttpErrorIncomplete;
+    }
+    if (raw.items[pos + 1] == '\n') {
+      *line_end = pos;
+      *next_line = pos + 2;
+      return HttpErrorNil;
+    }
+  }
+
+  // Bare CR or a control character
+  return HttpErrorParse;
 }
 
-void http_response_encode(const HttpResponse *response, StringBuilder *sb) {
-  sb_push_str(sb, "HTTP/1.1 ");
-  sb_push_long(sb, response->status_code);
-  sb_push_str(sb, " ");
-  sb_push_sv(sb, http_status_code_to_string(response->status_code));
-  sb_push_str(sb, CRLF);
-  sb_push_str(sb, "Content-Length: ");
-  sb_push_long(sb, (long)response->body.length);
-  sb_push_str(sb, CRLF);
-  if (response->body.length > 0) {
-    sb_push_str(sb, "Content-Type: ");
-    sb_push_sv(sb, response->content_type);
-    sb_push_str(sb, CRLF);
-  }
-  if (response->keep_alive) {
-    sb_push_str(sb, "Connection: keep-alive");
-    sb_push_str(sb, CRLF);
-  } else {
-    sb_push_str(sb, "Connection: close");
-    sb_push_str(sb, CRLF);
-  }
-  sb_push_str(sb, "Date: ");
-  sb_push_str(sb, http_date());
-  sb_push_str(sb, CRLF);
-  for (int i = 0; i < response->headers.capacity; i++) {
-    HashTableEntry entry = response->headers.entries[i];
-    if (entry.key != NULL) {
-      sb_push_sv(sb, *(String *)entry.key);
-      sb_push_str(sb, ": ");
-      const HeaderValues *values = (HeaderValues *)entry.value;
-      if (values != NULL) {
-        for (int j = 0; j < values->length; j++) {
-          sb_push_sv(sb, values->items[j]);
-          if (j < values->length-1) sb_push_char(sb, ',');
+// Tokenizes the header block in a single pass: header names are scanned as
+// tchars up to ':' and values as field characters up to CRLF
+HttpError http_parser_headers(HttpParser *parser, String raw) {
+  size_t line_end, next_line;
+  HttpError err;
+
+  while (!parser->headers_done) {
+    if (!parser->request_line_done) {
+      err = http_parser_line_end(parser, raw, &line_end, &next_line);
+      if (err != HttpErrorNil) {
+        return err;
+      }
+      String line = SV2(raw.items + parser->line_start, line_end - parser->line_start);
+      err = http_parser_request_line(parser, raw, line);
+      if (err != HttpErrorNil) {
+        return err;
+      }
+      parser->scanned = parser->line_start = next_line;
+      continue;
+    }
+
+    if (parser->colon == 0) {
+      const size_t pos = parser->scanned +
+          http_scan_token(raw.items + parser->scanned, raw.length - parser->scanned);
+      if (pos == raw.length) {
+        parser->scanned = pos;
+        return HttpErrorIncomplete;
+      }
+
+      const char ch = raw.items[pos];
+      if (ch == ':' && pos > parser->line_start) {
+        parser->colon = pos;
+        parser->scanned = pos + 1;
+      } else if ((ch == '\r' || ch == '\n') && pos == parser->line_start) {
+        // Blank line ends the header block
+        parser->scanned = pos;
+        err = http_parser_line_end(parser, raw, &line_end, &next_line);
+        if (err != HttpErrorNil) {
+          return err;
         }
+        parser->headers_done = true;
+        parser->header_length = next_line;
+        parser->scanned = parser->line_start = next_line;
+        return HttpErrorNil;
+      } else {
+        return HttpErrorParse;
       }
-      sb_push_str(sb, CRLF);
     }
+
+    err = http_parser_line_end(parser, raw, &line_end, &next_line);
+    if (err != HttpErrorNil) {
+      return err;
+    }
+
+    String key = SV2(raw.items + parser->line_start, parser->colon - parser->line_start);
+    String value = sv_trim(SV2(raw.items + parser->colon + 1, line_end - parser->colon - 1));
+    err = http_parser_header(parser, raw, key, value);
+    if (err != HttpErrorNil) {
+      return err;
+    }
+    parser->scanned = parser->line_start = next_line;
+    parser->colon = 0;
   }
-  sb_push_str(sb, CRLF);
-  if (response->body.length > 0) {
-    sb_push_sv(sb, response->body);
+
+  return HttpErrorNil;
+}
+
+// Returns the line starting at pos in the body, without its line ending
+HttpError http_parser_body_line(const HttpParser *parser, String raw, size_t pos,
+                                String *line, size_t *next) {
+  const char *body = raw.items + parser->header_length;
+  const size_t available = raw.length - parser->header_length - pos;
+  const char *end = memchr(body + pos, '\n', available);
+  if (end == NULL) {
+    return (available > HTTP_CHUNK_LINE_MAX) ? HttpErrorParse : HttpErrorIncomplete;
+  }
+
+  *line = SV2((char *)body + pos, end - (body + pos));
+  *next = pos + line->length + 1;
+  if (line->length > 0 && line->items[line->length - 1] == '\r') {
+    line->length--;
   }
+  return HttpErrorNil;
 }
 
-typedef struct {
-  int client_fd;
-  HttpListenCallback callback;
-} ClientThreadArgs;
+// Hex size up to an optional, ignored, chunk extension
+HttpError http_parse_chunk_size(String line, size_t *size) {
+  size_t i = 0;
+  *size = 0;
+  for (; i < line.length; i++) {
+    const char ch = line.items[i];
+    int digit;
+    if (ch >= '0' && ch <= '9') digit = ch - '0';
+    else if (ch >= 'a' && ch <= 'f') digit = ch - 'a' + 10;
+    else if (ch >= 'A' && ch <= 'F') digit = ch - 'A' + 10;
+    else break;
+    if (i == 15) {
+      return HttpErrorParse; // Overflow
+    }
+    *size = *size * 16 + digit;
+  }
+  if (i == 0 || (i < line.length && line.items[i] != ';' && line.items[i] != ' ' && line.items[i] != '\t')) {
+    return HttpErrorParse;
+  }
+  return HttpErrorNil;
+}
 
-void *handle_client(void *arg) {
-  ClientThreadArgs *args = arg;
-  const int client_fd = args->client_fd;
-  const HttpListenCallback callback = args->callback;
-  free(arg);
+// Decodes as much of the body as raw holds, framing is consumed on the way
+HttpError http_parser_body(HttpParser *parser, String raw) {
+  char *body = raw.items + parser->header_length;
+  const size_t available = raw.length - parser->header_length;
+  String line;
+  size_t next;
+  HttpError err;
+
+  while (parser->body_state != HTTP_BODY_DONE) {
+    switch (parser->body_state) {
+    case HTTP_BODY_START:
+      if (parser->chunked) {
+        // Both framings at once is how requests get smuggled
+        if (parser->content_length_set) {
+          ERROR("content length with chunked transfer encoding");
+          return HttpErrorParse;
+        }
+        parser->body_state = HTTP_BODY_CHUNK_SIZE;
+      } else {
+        parser->chunk_left = parser->content_length;
+        parser->body_state = (parser->chunk_left > 0) ? HTTP_BODY_DATA : HTTP_BODY_DONE;
+      }
+      break;
 
-  StringBuilder request_sb = {0};
-  StringBuilder response_sb = {0};
+    case HTTP_BODY_DATA: {
+      const size_t left = available - parser->body_scanned;
+      const size_t n = (parser->chunk_left < left) ? parser->chunk_left : left;
+      if (parser->body_length != parser->body_scanned) {
+        memmove(body + parser->body_length, body + parser->body_scanned, n);
+      }
+      parser->body_length += n;
+      parser->body_scanned += n;
+      parser->chunk_left -= n;
+      if (parser->chunk_left > 0) {
+        return HttpErrorIncomplete;
+      }
+      parser->body_state = parser->chunked ? HTTP_BODY_CHUNK_END : HTTP_BODY_DONE;
+      break;
+    }
 
-  sb_resize(&request_sb, HTTP_READ_BUFFER_SIZE);
-  sb_resize(&response_sb, HTTP_READ_BUFFER_SIZE);
+    case HTTP_BODY_CHUNK_SIZE:
+    case HTTP_BODY_CHUNK_END:
+    case HTTP_BODY_TRAILER:
+      err = http_parser_body_line(parser, raw, parser->body_scanned, &line, &next);
+      if (err != HttpErrorNil) {
+        return err;
+      }
+      parser->body_scanned = next;
 
-  while (true) {
-    request_sb.length = 0;
-    response_sb.length = 0;
+      if (parser->body_state == HTTP_BODY_CHUNK_SIZE) {
+        err = http_parse_chunk_size(line, &parser->chunk_left);
+        if (err != HttpErrorNil) {
+          ERROR("invalid chunk size");
+          return err;
+        }
+        parser->body_state = (parser->chunk_left > 0) ? HTTP_BODY_DATA : HTTP_BODY_TRAILER;
+      } else if (parser->body_state == HTTP_BODY_CHUNK_END) {
+        if (line.length > 0) {
+          return HttpErrorParse;
+        }
+        parser->body_state = HTTP_BODY_CHUNK_SIZE;
+      } else if (line.length == 0) {
+        parser->body_state = HTTP_BODY_DONE;
+      }
+      break;
 
-    HttpRequest request = {0};
-    const HttpError err = http_parse_request(client_fd, &request_sb, &request);
-    if (err == HttpErrorEOF || err == HttpErrorConnectionReset) {
+    case HTTP_BODY_DONE:
       break;
     }
-    if (err != HttpErrorNil) {
-      ERROR("http parse request failed: " SV_Fmt "\n", SV_Arg(http_error_to_string(err)));
-      break;
+  }
+
+  return HttpErrorNil;
+}
+
+// Parses a single request from the start of raw, returns HttpErrorIncomplete
+// until the full header block and body are available. Call again with the
+// same parser once more bytes are appended to raw.
+// On success request->raw_request spans exactly the bytes consumed.
+HttpError http_parse_request(HttpParser *parser, String raw, HttpRequest *request) {
+  assert(parser != NULL);
+  assert(request != NULL);
+
+  http_scan_init();
+  const HttpError err = http_parser_headers(parser, raw);
+  if (err != HttpErrorNil) {
+    return err;
+  }
+
+  // Body not received yet
+  const HttpError body_err = http_parser_body(parser, raw);
+  if (body_err != HttpErrorNil) {
+    return body_err;
+  }
+  const size_t request_length = parser->header_length + parser->body_scanned;
+
+  request->request_id = random_id();
+  request->method = http_span_sv(raw, parser->method);
+  request->path = http_span_sv(raw, parser->path);
+  request->proto = http_span_sv(raw, parser->proto);
+  HttpHeaders *headers = &request->headers;
+  headers->length = parser->header_count;
+  headers->indexed = false;
+  memset(headers->known, 0, sizeof(headers->known));
+  for (size_t i = 0; i < parser->header_count; i++) {
+    const HttpHeaderSpan header = parser->headers[i];
+    headers->items[i] = (HttpHeader){http_span_sv(raw, header.key),
+                                     http_span_sv(raw, header.value), header.id};
+    if (header.id != HTTP_HEADER_UNKNOWN && headers->known[header.id] == 0) {
+      headers->known[header.id] = i + 1;
     }
+  }
+  request->body = SV2(raw.items + parser->header_length, parser->body_length);
+  request->body_length = parser->body_length;
+  request->body_fd = -1;
+  request->raw_request = SV2(raw.items, request_length);
 
-    INFO("request received: " SV_Fmt, SV_Arg(http_request_to_string(request)));
+  return HttpErrorNil;
+}
 
-    HttpResponse response = callback(&request);
+// File cache
+// Per worker, so no locking. Entries are reference counted by the cache
+// slot and by responses still being written, an evicted file stays open
+// until its last response is sent.
+struct HttpFile {
+  char *path;
+  int fd;
+  size_t size;
+  time_t mtime;
+  ino_t ino;
+  String content_type;
+  char etag[64];
+  time_t checked_at; // Last stat of path
+  unsigned long last_used;
+  int refs;
+};
 
-    http_response_encode(&response, &response_sb);
-    http_response_write(client_fd, response_sb.items, response_sb.length);
+typedef struct {
+  HttpFile *items[HTTP_FILE_CACHE_SIZE];
+  size_t length;
+  unsigned long clock;
+} HttpFileCache;
 
-    // Cleanup
-    if (response.free_body_after_use)
-      free(response.body.items);
-    http_headers_free(&response.headers);
+_Thread_local HttpFileCache http_file_cache = {0};
 
-    if (!response.keep_alive) {
+typedef struct {
+  const char *extension;
+  const char *content_type;
+} HttpMimeType;
+
+const HttpMimeType http_mime_types[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/x-icon"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+};
+
+String http_content_type(String path) {
+  for (size_t i = path.length; i > 0; i--) {
+    const char ch = path.items[i - 1];
+    if (ch == '/') {
+      break;
+    }
+    if (ch == '.') {
+      const String extension = SV2(path.items + i, path.length - i);
+      for (size_t j = 0; j < sizeof(http_mime_types) / sizeof(http_mime_types[0]); j++) {
+        const HttpMimeType *mime = &http_mime_types[j];
+        if (sv_equal_ignore_case(extension, SV2((char *)mime->extension, strlen(mime->extension))))
+          return SV2((char *)mime->content_type, strlen(mime->content_type));
+      }
       break;
     }
   }
+  return SV("application/octet-stream");
+}
 
-  close(client_fd);
-  sb_free(&request_sb);
-  sb_free(&response_sb);
-  return NULL;
+void http_file_release(HttpFile *file) {
+  file->refs--;
+  if (file->refs == 0) {
+    close(file->fd);
+    free(file->path);
+    free(file);
+  }
 }
 
-Error http_server_listen(const HttpServer *server, const HttpListenCallback callback) {
-  assert(server != NULL);
-  assert(server->sock_fd > 0);
-  assert(callback != NULL);
+void http_file_cache_remove(HttpFileCache *cache, size_t i) {
+  HttpFile *file = cache->items[i];
+  cache->items[i] = cache->items[--cache->length];
+  http_file_release(file);
+}
 
-  if (listen(server->sock_fd, HTTP_BACKLOG) < 0) {
-    return errorf("listen failed: %s\n", strerror(errno));
+HttpFile *http_file_cache_insert(HttpFileCache *cache, const char *path) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
   }
 
-  INFO("server started");
-  while (true) {
-    const int client_fd = accept(server->sock_fd, NULL, NULL);
-    if (client_fd < 0) {
-      ERROR("accept failed: %s\n", strerror(errno));
-      continue;
+  // Least recently used goes first
+  if (cache->length == HTTP_FILE_CACHE_SIZE) {
+    size_t lru = 0;
+    for (size_t i = 1; i < cache->length; i++) {
+      if (cache->items[i]->last_used < cache->items[lru]->last_used)
+        lru = i;
     }
+    http_file_cache_remove(cache, lru);
+  }
+
+  HttpFile *file = malloc(sizeof(HttpFile));
+  assert(file != NULL);
+  file->path = strdup(path);
+  assert(file->path != NULL);
+  file->fd = fd;
+  file->size = (size_t)st.st_size;
+  file->mtime = st.st_mtime;
+  file->ino = st.st_ino;
+  file->content_type = http_content_type(SV2(file->path, strlen(file->path)));
+  snprintf(file->etag, sizeof(file->etag), "\"%lx-%lx-%lx\"", (unsigned long)st.st_ino,
+           (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+  file->checked_at = time(NULL);
+  file->refs = 1; // Held by the cache
+  cache->items[cache->length++] = file;
+  return file;
+}
 
-    ClientThreadArgs *arg = malloc(sizeof(ClientThreadArgs));
-    arg->client_fd = client_fd;
-    arg->callback = callback;
+// Returns the cached file with a reference for the caller, or NULL
+HttpFile *http_file_open(const char *path) {
+  HttpFileCache *cache = &http_file_cache;
+  const time_t now = time(NULL);
 
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, handle_client, arg) != 0) {
-      free(arg);
-      close(client_fd);
-      ERROR("pthread_create failed: %s\n", strerror(errno));
+  HttpFile *file = NULL;
+  for (size_t i = 0; i < cache->length; i++) {
+    if (strcmp(cache->items[i]->path, path) != 0) {
       continue;
     }
 
-    pthread_detach(tid);
+    file = cache->items[i];
+    if (now - file->checked_at >= HTTP_FILE_REVALIDATE) {
+      // Replaced, truncated or modified since it was opened
+      struct stat st;
+      if (stat(path, &st) < 0 || st.st_ino != file->ino ||
+          st.st_mtime != file->mtime || (size_t)st.st_size != file->size) {
+        http_file_cache_remove(cache, i);
+        file = NULL;
+      } else {
+        file->checked_at = now;
+      }
+    }
+    break;
   }
 
-  assert(false && "unreachable");
-}
+  if (file == NULL) {
+    file = http_file_cache_insert(cache, path);
+    if (file == NULL) {
+      return NULL;
+    }
+  }
 
-void http_server_free(const HttpServer *server) { close(server->sock_fd); }
+  file->last_used = ++cache->clock;
+  file->refs++;
+  return file;
+}
 
-HttpResponse http_response_init(int status_code) {
-  HttpResponse response = {0};
-  response.headers = http_headers_init();
-  response.status_code = status_code;
-  response.keep_alive = true;
-  response.free_body_after_use = false;
+String http_status_code_to_string(const int status_code) {
+  switch (status_code) {
+  case 200:
+    return SV("OK");
+  case 201:
+    return SV("Created");
+  case 204:
+    return SV("No Content");
+  case 206:
+    return SV("Partial Content");
+  case 301:
+    return SV("Moved Permanently");
+  case 304:
+    return SV("Not Modified");
+  case 400:
+    return SV("Bad Request");
+  case 404:
+    return SV("Not Found");
+  case 405:
+    return SV("Method Not Allowed");
+  case 413:
+    return SV("Content Too Large");
+  case 416:
+    return SV("Range Not Satisfiable");
+  case 431:
+    return SV("Request Header Fields Too Large");
+  case 500:
+    return SV("Internal Server Error");
+  case 503:
+    return SV("Service Unavailable");
+  default:
+    return SV("Unknown");
+  }
+}
+
+// Pre-encoded status lines for the codes the server produces itself,
+// empty for anything else so the encoder falls back to formatting
+String http_status_line(const int status_code) {
+  switch (status_code) {
+  case 200:
+    return SV("HTTP/1.1 200 OK" CRLF);
+  case 201:
+    return SV("HTTP/1.1 201 Created" CRLF);
+  case 204:
+    return SV("HTTP/1.1 204 No Content" CRLF);
+  case 206:
+    return SV("HTTP/1.1 206 Partial Content" CRLF);
+  case 301:
+    return SV("HTTP/1.1 301 Moved Permanently" CRLF);
+  case 304:
+    return SV("HTTP/1.1 304 Not Modified" CRLF);
+  case 400:
+    return SV("HTTP/1.1 400 Bad Request" CRLF);
+  case 404:
+    return SV("HTTP/1.1 404 Not Found" CRLF);
+  case 405:
+    return SV("HTTP/1.1 405 Method Not Allowed" CRLF);
+  case 413:
+    return SV("HTTP/1.1 413 Content Too Large" CRLF);
+  case 416:
+    return SV("HTTP/1.1 416 Range Not Satisfiable" CRLF);
+  case 431:
+    return SV("HTTP/1.1 431 Request Header Fields Too Large" CRLF);
+  case 500:
+    return SV("HTTP/1.1 500 Internal Server Error" CRLF);
+  case 503:
+    return SV("HTTP/1.1 503 Service Unavailable" CRLF);
+  default:
+    return (String){0};
+  }
+}
+
+// IMF-fixdate, buf needs 30 bytes
+void http_format_date(time_t t, char *buf, size_t size) {
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// The Connection and Date lines only change once a second, so each
+// thread keeps both variants formatted and rebuilds them when the second
+// rolls over. Being thread local the cache needs no locking and readers
+// can never see a half written date.
+#define HTTP_KEEP_ALIVE_LINE "Connection: keep-alive" CRLF "Date: "
+#define HTTP_CLOSE_LINE "Connection: close" CRLF "Date: "
+#define HTTP_DATE_LENGTH 29
+
+typedef struct {
+  time_t second;
+  char date[HTTP_DATE_LENGTH + 1];
+  char keep_alive[sizeof(HTTP_KEEP_ALIVE_LINE) + HTTP_DATE_LENGTH + 2];
+  char close[sizeof(HTTP_CLOSE_LINE) + HTTP_DATE_LENGTH + 2];
+  size_t keep_alive_length;
+  size_t close_length;
+} HttpDateCache;
+
+static _Thread_local HttpDateCache http_date_cache = {.second = -1};
+
+static HttpDateCache *http_date_refresh(void) {
+  HttpDateCache *cache = &http_date_cache;
+  const time_t now = time(NULL);
+  if (now != cache->second) {
+    http_format_date(now, cache->date, sizeof(cache->date));
+    cache->keep_alive_length = (size_t)snprintf(cache->keep_alive, sizeof(cache->keep_alive), HTTP_KEEP_ALIVE_LINE "%s" CRLF, cache->date);
+    cache->close_length = (size_t)snprintf(cache->close, sizeof(cache->close), HTTP_CLOSE_LINE "%s" CRLF, cache->date);
+    cache->second = now;
+  }
+  return cache;
+}
+
+char *http_date(void) {
+  return http_date_refresh()->date;
+}
+
+// Returns 0 when the date can't be parsed
+time_t http_parse_date(String date) {
+  const char *str = tprintf(SV_Fmt, SV_Arg(date)).items;
+  struct tm tm = {0};
+  const char *end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != 0) {
+    return 0;
+  }
+  return timegm(&tm);
+}
+
+// FNV-1a over the body
+String http_etag(String body, bool weak) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < body.length; i++) {
+    hash ^= (unsigned char)body.items[i];
+    hash *= 1099511628211ULL;
+  }
+  return tprintf("%s\"%zx-%016lx\"", weak ? "W/" : "", body.length, (unsigned long)hash);
+}
+
+String http_etag_opaque(String etag) {
+  if (etag.length >= 2 && etag.items[0] == 'W' && etag.items[1] == '/') {
+    return SV2(etag.items + 2, etag.length - 2);
+  }
+  return etag;
+}
+
+bool http_request_not_modified(const HttpRequest *request, String etag, time_t last_modified) {
+  // If-None-Match wins over If-Modified-Since, compared weakly
+  const String none_match = http_request_known_header(request, HTTP_HEADER_IF_NONE_MATCH);
+  if (none_match.length > 0) {
+    if (etag.length == 0) {
+      return false;
+    }
+    StringPair p = sv_split_delim(none_match, ',');
+    while (p.first.length > 0 || p.second.length > 0) {
+      const String candidate = sv_trim(p.first);
+      if (sv_equal(candidate, SV("*")) ||
+          sv_equal(http_etag_opaque(candidate), http_etag_opaque(etag)))
+        return true;
+      p = sv_split_delim(p.second, ',');
+    }
+    return false;
+  }
+
+  const String modified_since = http_request_known_header(request, HTTP_HEADER_IF_MODIFIED_SINCE);
+  if (modified_since.length > 0 && last_modified != 0) {
+    const time_t since = http_parse_date(sv_trim(modified_since));
+    return since != 0 && last_modified <= since;
+  }
+  return false;
+}
+
+// Whether an If-Range validator still matches, entity tags compare strongly
+bool http_request_if_range(const HttpRequest *request, const HttpResponse *response) {
+  const String if_range = sv_trim(http_request_known_header(request, HTTP_HEADER_IF_RANGE));
+  if (if_range.length == 0) {
+    return true;
+  }
+  if (if_range.items[0] == '"') {
+    return response->etag.length > 0 && response->etag.items[0] == '"' &&
+           sv_equal(if_range, response->etag);
+  }
+  return response->last_modified != 0 && http_parse_date(if_range) == response->last_modified;
+}
+
+// Parses "bytes=" ranges against total, false when the header is to be ignored
+bool http_parse_ranges(String header, size_t total, HttpRanges *ranges) {
+  header = sv_trim(header);
+  if (header.length < 6 || !sv_equal_ignore_case(SV2(header.items, 6), SV("bytes="))) {
+    return false;
+  }
+  ranges->length = 0;
+  ranges->total = total;
+
+  StringPair p = sv_split_delim(SV2(header.items + 6, header.length - 6), ',');
+  while (p.first.length > 0 || p.second.length > 0) {
+    const String spec = sv_trim(p.first);
+    p = sv_split_delim(p.second, ',');
+    if (spec.length == 0) {
+      continue;
+    }
+
+    const StringPair bounds = sv_split_delim(spec, '-');
+    if (bounds.first.length + bounds.second.length + 1 != spec.length) {
+      return false; // No dash
+    }
+    const String first = sv_trim(bounds.first);
+    const String last = sv_trim(bounds.second);
+    for (size_t i = 0; i < first.length; i++)
+      if (!isdigit((unsigned char)first.items[i])) return false;
+    for (size_t i = 0; i < last.length; i++)
+      if (!isdigit((unsigned char)last.items[i])) return false;
+
+    HttpRange range;
+    if (first.length == 0) {
+      // Suffix, the last n bytes
+      if (last.length == 0) {
+        return false;
+      }
+      const size_t n = strtoull(tprintf(SV_Fmt, SV_Arg(last)).items, NULL, 10);
+      if (n == 0 || total == 0) {
+        continue;
+      }
+      range.start = (n >= total) ? 0 : total - n;
+      range.end = total - 1;
+    } else {
+      range.start = strtoull(tprintf(SV_Fmt, SV_Arg(first)).items, NULL, 10);
+      range.end = (last.length > 0) ? strtoull(tprintf(SV_Fmt, SV_Arg(last)).items, NULL, 10) : SIZE_MAX;
+      if (range.end < range.start) {
+        return false;
+      }
+      if (range.start >= total) {
+        continue; // Unsatisfiable
+      }
+      if (range.end >= total) {
+        range.end = total - 1;
+      }
+    }
+
+    if (ranges->length == HTTP_MAX_RANGES) {
+      return false;
+    }
+    ranges->items[ranges->length++] = range;
+  }
+  return true;
+}
+
+void http_stream_free(HttpStream *stream) {
+  if (stream->free != NULL)
+    stream->free(stream->data);
+  *stream = (HttpStream){0};
+}
+
+void http_response_drop_body(HttpResponse *response) {
+  http_stream_free(&response->stream);
+  if (response->free_body_after_use)
+    MEM_FREE(response->body.items);
+  if (response->file != NULL)
+    http_file_release(response->file);
+  response->free_body_after_use = false;
+  response->file = NULL;
+  response->body = StringNil;
+}
+
+// Turns a full 200 into a 304, 206 or 416 as the request asks
+void http_response_conditional(const HttpRequest *request, HttpResponse *response) {
+  if (response->status_code != 200 ||
+      (!sv_equal(request->method, SV("GET")) && !sv_equal(request->method, SV("HEAD")))) {
+    return;
+  }
+
+  if (http_request_not_modified(request, response->etag, response->last_modified)) {
+    http_response_drop_body(response);
+    response->status_code = 304;
+    return;
+  }
+
+  const String range = http_request_known_header(request, HTTP_HEADER_RANGE);
+  if (range.length == 0 || !response->accept_ranges || response->stream.produce != NULL ||
+      !http_request_if_range(request, response)) {
+    return;
+  }
+
+  const size_t total = (response->file != NULL) ? response->file->size : response->body.length;
+  HttpRanges *ranges = &response->ranges;
+  if (!http_parse_ranges(range, total, ranges)) {
+    ranges->length = 0;
+    return;
+  }
+  if (ranges->length == 0) {
+    http_response_drop_body(response);
+    response->status_code = 416;
+    return;
+  }
+
+  response->status_code = 206;
+  if (ranges->length > 1) {
+    ranges->boundary = random_id();
+  }
+}
+
+// Part header preceding each range of a multipart/byteranges body
+String http_range_part_header(const HttpResponse *response, size_t i) {
+  const HttpRange *range = &response->ranges.items[i];
+  return tprintf(CRLF "--" SV_Fmt CRLF "Content-Type: " SV_Fmt CRLF "Content-Range: bytes %zu-%zu/%zu" CRLF CRLF,
+                 SV_Arg(response->ranges.boundary), SV_Arg(response->content_type),
+                 range->start, range->end, response->ranges.total);
+}
+
+String http_range_part_end(const HttpResponse *response) {
+  return tprintf(CRLF "--" SV_Fmt "--" CRLF, SV_Arg(response->ranges.boundary));
+}
+
+size_t http_response_content_length(const HttpResponse *response) {
+  const HttpRanges *ranges = &response->ranges;
+  if (response->status_code == 206) {
+    size_t length = 0;
+    for (size_t i = 0; i < ranges->length; i++) {
+      length += ranges->items[i].end - ranges->items[i].start + 1;
+      if (ranges->length > 1)
+        length += http_range_part_header(response, i).length;
+    }
+    if (ranges->length > 1)
+      length += http_range_part_end(response).length;
+    return length;
+  }
+  return (response->file != NULL) ? response->file->size : response->body.length;
+}
+
+// The head is encoded in three parts so the response cache can store
+// everything except the per response Connection and Date lines and the per
+// request headers, which all go right after the status line
+
+void http_response_encode_status(const HttpResponse *response, StringBuilder *sb) {
+  const String line = http_status_line(response->status_code);
+  if (line.length > 0) {
+    sb_push_sv(sb, line);
+    return;
+  }
+  sb_push_sv(sb, SV("HTTP/1.1 "));
+  sb_push_long(sb, response->status_code);
+  sb_push_char(sb, ' ');
+  sb_push_sv(sb, http_status_code_to_string(response->status_code));
+  sb_push_sv(sb, SV(CRLF));
+}
+
+void http_response_encode_connection(bool keep_alive, StringBuilder *sb) {
+  HttpDateCache *cache = http_date_refresh();
+  if (keep_alive) {
+    sb_push_sv(sb, SV2(cache->keep_alive, cache->keep_alive_length));
+  } else {
+    sb_push_sv(sb, SV2(cache->close, cache->close_length));
+  }
+}
+
+void http_headers_encode(const HashTable *headers, StringBuilder *sb) {
+  for (int i = 0; i < headers->capacity; i++) {
+    HashTableEntry entry = headers->entries[i];
+    if (entry.key != NULL) {
+      sb_push_sv(sb, *(String *)entry.key);
+      sb_push_sv(sb, SV(": "));
+      const HeaderValues *values = (HeaderValues *)entry.value;
+      if (values != NULL) {
+        for (int j = 0; j < values->length; j++) {
+          sb_push_sv(sb, values->items[j]);
+          if (j < values->length-1) sb_push_char(sb, ',');
+        }
+      }
+      sb_push_sv(sb, SV(CRLF));
+    }
+  }
+}
+
+void http_response_encode_fields(const HttpResponse *response, StringBuilder *sb) {
+  const size_t content_length = http_response_content_length(response);
+  const bool streamed = response->stream.produce != NULL;
+  if (streamed) {
+    // Without keep alive the end of the body is marked by closing
+    if (response->keep_alive)
+      sb_push_sv(sb, SV("Transfer-Encoding: chunked" CRLF));
+  } else if (response->status_code != 304 && response->status_code != 204) {
+    sb_push_sv(sb, SV("Content-Length: "));
+    sb_push_long(sb, (long)content_length);
+    sb_push_sv(sb, SV(CRLF));
+  }
+  if (response->status_code == 206 && response->ranges.length > 1) {
+    sb_push_sv(sb, SV("Content-Type: multipart/byteranges; boundary="));
+    sb_push_sv(sb, response->ranges.boundary);
+    sb_push_sv(sb, SV(CRLF));
+  } else if (content_length > 0 || streamed) {
+    sb_push_sv(sb, SV("Content-Type: "));
+    sb_push_sv(sb, response->content_type);
+    sb_push_sv(sb, SV(CRLF));
+  }
+  if (response->status_code == 206 && response->ranges.length == 1) {
+    const HttpRange *range = &response->ranges.items[0];
+    sb_push_sv(sb, tprintf("Content-Range: bytes %zu-%zu/%zu" CRLF, range->start, range->end, response->ranges.total));
+  } else if (response->status_code == 416) {
+    sb_push_sv(sb, tprintf("Content-Range: bytes */%zu" CRLF, response->ranges.total));
+  }
+  if (response->etag.length > 0) {
+    sb_push_sv(sb, SV("ETag: "));
+    sb_push_sv(sb, response->etag);
+    sb_push_sv(sb, SV(CRLF));
+  }
+  if (response->last_modified != 0) {
+    char date[32];
+    http_format_date(response->last_modified, date, sizeof(date));
+    sb_push_sv(sb, SV("Last-Modified: "));
+    sb_push_str(sb, date);
+    sb_push_sv(sb, SV(CRLF));
+  }
+  if (response->accept_ranges) {
+    sb_push_sv(sb, SV("Accept-Ranges: bytes" CRLF));
+  }
+  http_headers_encode(&response->headers, sb);
+  sb_push_sv(sb, SV(CRLF));
+}
+
+void http_response_encode_head(const HttpResponse *response, StringBuilder *sb) {
+  http_response_encode_status(response, sb);
+  http_response_encode_connection(response->keep_alive, sb);
+  http_headers_encode(&response->request_headers, sb);
+  http_response_encode_fields(response, sb);
+}
+
+void http_response_encode(const HttpResponse *response, StringBuilder *sb) {
+  http_response_encode_head(response, sb);
+  if (response->body.length > 0) {
+    sb_push_sv(sb, response->body);
+  }
+}
+
+// Copies the in memory body, or the ranges of a 206 taken from it
+void http_response_encode_body(const HttpResponse *response, StringBuilder *sb) {
+  if (response->status_code != 206) {
+    sb_push_sv(sb, response->body);
+    return;
+  }
+  const HttpRanges *ranges = &response->ranges;
+  for (size_t i = 0; i < ranges->length; i++) {
+    const HttpRange *range = &ranges->items[i];
+    if (ranges->length > 1) {
+      sb_push_sv(sb, http_range_part_header(response, i));
+    }
+    sb_push_sv(sb, SV2(response->body.items + range->start, range->end - range->start + 1));
+  }
+  if (ranges->length > 1) {
+    sb_push_sv(sb, http_range_part_end(response));
+  }
+}
+
+// Response cache entries hold encoded responses minus their Connection and
+// Date lines so hits skip both the handler and the encoder
+typedef struct HttpCacheEntry {
+  struct HttpCacheEntry *chain; // Next in the same bucket
+  struct HttpCacheEntry *newer;
+  struct HttpCacheEntry *older;
+  uint64_t hash;
+  long expires_ms;
+  size_t key_length;
+  size_t split;  // End of the status line, where Connection and Date go
+  size_t length; // Encoded response following the key
+  char data[];
+} HttpCacheEntry;
+
+typedef struct {
+  HttpCacheEntry **buckets;
+  size_t bucket_count; // Power of two
+  size_t entries;
+  HttpCacheEntry *newest;
+  HttpCacheEntry *oldest;
+  size_t size; // Bytes held by entries
+  size_t capacity;
+} HttpResponseCache;
+
+// Large body written straight from the handler's buffer
+typedef struct {
+  size_t offset; // Position in response_sb the body is written after
+  String body;   // Only the length is used for files
+  bool owned;    // MEM_FREE once written
+  HttpFile *file;
+  size_t file_offset;
+} HttpBodySlice;
+
+typedef ARRAY(HttpBodySlice) HttpBodySlices;
+
+// Per connection state, owned by the event loop it was assigned to
+typedef struct HttpConnection {
+  int fd;
+  StringBuilder request_sb;  // Bytes received but not consumed yet
+  StringBuilder response_sb; // Encoded responses not fully written yet
+  size_t response_written;
+  HttpBodySlices bodies;     // Interleaved with response_sb when writing
+  size_t body_index;         // First body not fully written
+  size_t body_written;
+  size_t body_pending;       // Body bytes queued but not written
+  HttpStream stream;         // Streamed body still being produced
+  bool stream_chunked;
+  HttpParser parser;         // State of the partially received request
+  int body_fd;               // Spill file of the request being received, otherwise -1
+  size_t body_spilled;
+  bool read_paused;          // Stopped at the buffer limit, the socket may have more
+  bool keep_alive;
+  bool eof; // Peer has shut down its side
+  bool in_flight; // Holds a unit of the in flight budget until its responses are written
+  struct HttpDeferred *deferred; // Request answered later, the ones behind it wait
+
+  // Timer wheel entry, see http_connection_arm_timer
+  long deadline_ms; // 0 when no timer is set
+  long request_started_ms; // First byte of the request being received
+  struct HttpConnection *timer_next;
+  struct HttpConnection **timer_pprev;
+
+  // io_uring backend only
+  int inflight; // Submitted operations not completed yet
+  bool recv_armed;
+  bool send_inflight;
+  bool closing;
+  struct iovec iov[HTTP_IOV_MAX]; // Must stay put while a sendmsg is in flight
+  struct msghdr msg;
+  char *file_buf;         // Piece of the file body due next, see http_uring_read_file
+  size_t file_buf_start;  // Where the piece starts in that body, both 0 between files
+  size_t file_buf_length;
+} HttpConnection;
+
+// Hashed timer wheel, one per loop. A connection sits in the slot of its
+// deadline's tick, deadlines further than a turn away stay put until their
+// round comes. Arming and cancelling are O(1) list operations and the loop
+// only needs a timeout on its wait, no timer syscalls per connection.
+#define HTTP_TIMER_TICK_MS 250
+#define HTTP_TIMER_SLOTS 512 // Power of two, a turn is 128 seconds
+
+typedef struct {
+  HttpConnection *slots[HTTP_TIMER_SLOTS];
+  long tick;    // Next tick to expire
+  size_t count; // Connections with a timer set
+} HttpTimerWheel;
+
+typedef struct {
+  int epoll_fd;
+  int listen_fd; // Own SO_REUSEPORT listener when sharding, otherwise -1
+  int cpu;       // CPU the loop is pinned to, otherwise -1
+  pthread_t tid;
+  HttpListenCallback callback;
+  const HttpServer *server;
+  Arena arena; // Per request allocations, reset after each response
+  HttpResponseCache cache;
+  HttpTimerWheel timers;
+  long now_ms; // Taken once per wakeup
+  String overloaded; // Pre-encoded 503, shared by all loops
+  bool accept_paused; // Over the connection budget or out of descriptors
+  long accept_retry_ms;
+
+  // Deferred responses completed by other threads, signalled on wake_fd
+  int wake_fd;
+  pthread_mutex_t deferred_lock;
+  struct HttpDeferred *deferred_done;
+  bool woken;
+
+  bool uring;
+  Uring ring;
+  UringBufRing buf_ring;
+  bool timeout_armed;
+  bool accept_armed;
+  struct __kernel_timespec timeout; // Must stay put while the timeout is in flight
+  uint64_t wake_count;              // Must stay put while the wake read is in flight
+} HttpEventLoop;
+
+// Answered once a handler on another thread completes it. The request is
+// copied so it outlives the connection's buffer, the response is encoded
+// by the completing thread and only appended by the worker. Coalesced
+// followers park on one holding their flight and nothing else.
+struct HttpDeferred {
+  struct HttpDeferred *next; // In the loop's completed list, or the flight's waiters
+  HttpEventLoop *loop;
+  struct HttpFlight *flight; // Joined as a follower, the request is still buffered
+  HttpConnection *conn; // NULL once the connection is gone, worker only
+  bool ready;           // Taken off the completed list, worker only
+  HttpRequest request;
+  char *raw; // Backs the strings of request
+  StringBuilder encoded;
+  HttpStream stream;
+  bool stream_chunked;
+  bool keep_alive;
+  HttpDeferFinish finish; // See http_defer_finish
+  void *finish_state;
+};
+
+void http_flight_release(struct HttpFlight *flight);
+
+void http_deferred_free(HttpDeferred *deferred) {
+  if (deferred->request.body_fd >= 0)
+    close(deferred->request.body_fd);
+  free(deferred->raw);
+  free(deferred->encoded.items);
+  http_stream_free(&deferred->stream);
+  free(deferred->finish_state);
+  if (deferred->flight != NULL)
+    http_flight_release(deferred->flight);
+  free(deferred);
+}
+
+// Hands a completed deferred back to its worker, from any thread
+void http_deferred_wake(HttpDeferred *deferred) {
+  HttpEventLoop *loop = deferred->loop;
+  pthread_mutex_lock(&loop->deferred_lock);
+  deferred->next = loop->deferred_done;
+  loop->deferred_done = deferred;
+  pthread_mutex_unlock(&loop->deferred_lock);
+
+  const uint64_t one = 1;
+  if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    ERROR("eventfd write failed: %s", strerror(errno));
+  }
+}
+
+// Load shedding budgets are shared by all workers
+atomic_long http_connections_open = 0;
+atomic_long http_requests_in_flight = 0;
+atomic_ulong http_requests_shed = 0;
+
+HttpLoadStats http_load_stats(void) {
+  return (HttpLoadStats){
+      .connections = atomic_load_explicit(&http_connections_open, memory_order_relaxed),
+      .in_flight = atomic_load_explicit(&http_requests_in_flight, memory_order_relaxed),
+      .shed = atomic_load_explicit(&http_requests_shed, memory_order_relaxed),
+  };
+}
+
+// Takes one unit of budget, false once max units are taken, 0 is unlimited
+bool http_budget_acquire(atomic_long *used, int max) {
+  const long n = atomic_fetch_add_explicit(used, 1, memory_order_relaxed);
+  if (max > 0 && n >= max) {
+    atomic_fetch_sub_explicit(used, 1, memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+bool http_budget_available(atomic_long *used, int max) {
+  return max <= 0 || atomic_load_explicit(used, memory_order_relaxed) < max;
+}
+
+// Encoded once when listening, 5xx responses may leave out Date so it
+// never changes
+String http_overloaded_response(int retry_after) {
+  StringBuilder sb = {0};
+  sb_push_sv(&sb, http_status_line(503));
+  sb_push_sv(&sb, SV("Connection: close" CRLF "Retry-After: "));
+  sb_push_long(&sb, retry_after);
+  sb_push_sv(&sb, SV(CRLF "Content-Length: 0" CRLF CRLF));
+  return sb_to_sv(&sb);
+}
+
+// Answers a connection accepted over budget before reading anything. Best
+// effort, a client still sending may see a reset instead.
+void http_connection_shed(int fd, String overloaded) {
+  atomic_fetch_add_explicit(&http_requests_shed, 1, memory_order_relaxed);
+  send(fd, overloaded.items, overloaded.length, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(fd);
+}
+
+long http_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+HttpConnection *http_connection_new(int fd) {
+  HttpConnection *conn = malloc(sizeof(HttpConnection));
+  assert(conn != NULL);
+  *conn = (HttpConnection){0};
+  conn->fd = fd;
+  conn->body_fd = -1;
+  conn->request_started_ms = http_now_ms(); // Bound by the header timeout from the start
+  conn->keep_alive = true;
+  sb_resize(&conn->request_sb, HTTP_READ_BUFFER_SIZE);
+  sb_resize(&conn->response_sb, HTTP_READ_BUFFER_SIZE);
+  return conn;
+}
+
+void http_connection_free(HttpConnection *conn) {
+  // Closing the fd also removes it from the epoll set
+  close(conn->fd);
+  atomic_fetch_sub_explicit(&http_connections_open, 1, memory_order_relaxed);
+  if (conn->in_flight)
+    atomic_fetch_sub_explicit(&http_requests_in_flight, 1, memory_order_relaxed);
+  if (conn->body_fd >= 0)
+    close(conn->body_fd);
+  sb_free(&conn->request_sb);
+  sb_free(&conn->response_sb);
+  for (size_t i = conn->body_index; i < conn->bodies.length; i++) {
+    if (conn->bodies.items[i].owned)
+      MEM_FREE(conn->bodies.items[i].body.items);
+    if (conn->bodies.items[i].file != NULL)
+      http_file_release(conn->bodies.items[i].file);
+  }
+  array_free(&conn->bodies);
+  free(conn->file_buf);
+  http_stream_free(&conn->stream);
+  if (conn->deferred != NULL) {
+    // Freed by the worker once completed, unless that already happened
+    if (conn->deferred->ready)
+      http_deferred_free(conn->deferred);
+    else
+      conn->deferred->conn = NULL;
+  }
+  free(conn);
+}
+
+// Bytes buffered per connection before reading pauses. Refusing oversized
+// header blocks and spilling or refusing large bodies keeps a single
+// request below it, so a paused connection always makes progress.
+size_t http_read_limit(const HttpServer *server) {
+  return HTTP_MAX_HEADER_SIZE + server->options.max_body_memory + HTTP_CHUNK_LINE_MAX + 1;
+}
+
+// Reads until the socket would block or limit bytes are buffered
+HttpError http_connection_read(HttpConnection *conn, size_t limit) {
+  StringBuilder *sb = &conn->request_sb;
+  conn->read_paused = false;
+  while (true) {
+    if (sb->length >= limit) {
+      conn->read_paused = true;
+      return HttpErrorNil;
+    }
+    sb_reserve(sb, HTTP_READ_BUFFER_SIZE);
+
+    const ssize_t n = read(conn->fd, sb->items + sb->length, sb->capacity - sb->length);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return HttpErrorNil;
+      }
+      if (errno == ECONNRESET) {
+        return HttpErrorConnectionReset;
+      }
+      return HttpErrorRead;
+    }
+    if (n == 0) {
+      return HttpErrorEOF;
+    }
+    sb->length += n;
+  }
+}
+
+// Writes pending responses until done or the socket would block
+bool http_connection_write_pending(const HttpConnection *conn) {
+  return conn->response_sb.length > 0 || conn->bodies.length > 0;
+}
+
+// Returns the in flight budget once every response is written
+void http_connection_settle(HttpConnection *conn) {
+  if (conn->in_flight && !http_connection_write_pending(conn) && conn->stream.produce == NULL &&
+      conn->deferred == NULL) {
+    conn->in_flight = false;
+    atomic_fetch_sub_explicit(&http_requests_in_flight, 1, memory_order_relaxed);
+  }
+}
+
+// Queued response bytes, written or not, used for pipelining backpressure
+size_t http_connection_queued(const HttpConnection *conn) {
+  return conn->response_sb.length + conn->body_pending;
+}
+
+// Fills iov with the unwritten bytes in order up to the next file, or the
+// part of its piece in file_buf not written yet, returns the count used
+int http_connection_iov(const HttpConnection *conn, struct iovec *iov, int max) {
+  const StringBuilder *sb = &conn->response_sb;
+  size_t pos = conn->response_written;
+  int n = 0;
+  for (size_t i = conn->body_index; n < max; i++) {
+    const bool has_body = i < conn->bodies.length;
+    const size_t end = has_body ? conn->bodies.items[i].offset : sb->length;
+    if (end > pos) {
+      iov[n++] = (struct iovec){sb->items + pos, end - pos};
+      pos = end;
+    }
+    if (!has_body || n == max) {
+      break;
+    }
+    if (conn->bodies.items[i].file != NULL) {
+      const size_t piece_end = conn->file_buf_start + conn->file_buf_length;
+      if (n == 0 && conn->body_written < piece_end) {
+        iov[n++] = (struct iovec){conn->file_buf + conn->body_written - conn->file_buf_start,
+                                  piece_end - conn->body_written};
+      }
+      break;
+    }
+
+    const HttpBodySlice *slice = &conn->bodies.items[i];
+    const size_t skip = (i == conn->body_index) ? conn->body_written : 0;
+    iov[n++] = (struct iovec){slice->body.items + skip, slice->body.length - skip};
+  }
+  return n;
+}
+
+// Consumes n written bytes, resuming partial writes where they stopped
+void http_connection_advance(HttpConnection *conn, size_t n) {
+  StringBuilder *sb = &conn->response_sb;
+  while (n > 0) {
+    const bool has_body = conn->body_index < conn->bodies.length;
+    const size_t end = has_body ? conn->bodies.items[conn->body_index].offset : sb->length;
+    if (conn->response_written < end) {
+      const size_t step = (n < end - conn->response_written) ? n : end - conn->response_written;
+      conn->response_written += step;
+      n -= step;
+      continue;
+    }
+
+    assert(has_body);
+    HttpBodySlice *slice = &conn->bodies.items[conn->body_index];
+    const size_t left = slice->body.length - conn->body_written;
+    const size_t step = (n < left) ? n : left;
+    conn->body_written += step;
+    conn->body_pending -= step;
+    n -= step;
+    if (conn->body_written == slice->body.length) {
+      if (slice->owned)
+        MEM_FREE(slice->body.items);
+      if (slice->file != NULL) {
+        http_file_release(slice->file);
+        // The piece belonged to this slice, the next file starts unbuffered
+        conn->file_buf_start = 0;
+        conn->file_buf_length = 0;
+      }
+      conn->body_index++;
+      conn->body_written = 0;
+    }
+  }
+
+  if (conn->response_written == sb->length && conn->body_index == conn->bodies.length) {
+    sb->length = 0;
+    conn->response_written = 0;
+    conn->bodies.length = 0;
+    conn->body_index = 0;
+    http_connection_settle(conn);
+  }
+}
+
+// Chunk sizes are zero padded to a fixed width so the producer can append
+// straight after the size line, which is filled in afterwards
+#define HTTP_CHUNK_SIZE_WIDTH 8
+
+// Produces the streamed body into response_sb until the window is full or
+// the stream ends
+void http_connection_stream(HttpConnection *conn) {
+  HttpStream *stream = &conn->stream;
+  StringBuilder *sb = &conn->response_sb;
+  const size_t frame = conn->stream_chunked ? HTTP_CHUNK_SIZE_WIDTH + 2 : 0;
+  while (stream->produce != NULL && http_connection_queued(conn) < HTTP_STREAM_WINDOW) {
+    const size_t max = HTTP_STREAM_WINDOW - http_connection_queued(conn);
+    const size_t start = sb->length;
+    sb_reserve(sb, frame);
+    sb->length += frame;
+
+    TempMark mark = tmark();
+    const bool more = stream->produce(stream->data, sb, max);
+    trewind(mark);
+
+    const size_t n = sb->length - start - frame;
+    if (n == 0) {
+      sb->length = start;
+      sb->items[sb->length] = 0;
+      if (more) {
+        // Would be called again straight away forever. The body is cut
+        // short without its last chunk so the client sees it failed.
+        ERROR("stream produced nothing without ending, closing the connection");
+        http_stream_free(stream);
+        conn->keep_alive = false;
+        http_connection_settle(conn);
+        return;
+      }
+    } else if (frame > 0) {
+      assert(n <= 0xffffffff);
+      char size[HTTP_CHUNK_SIZE_WIDTH + 3];
+      snprintf(size, sizeof(size), "%0*zx" CRLF, HTTP_CHUNK_SIZE_WIDTH, n);
+      memcpy(sb->items + start, size, frame);
+      sb_push_sv(sb, SV(CRLF));
+    }
+
+    if (!more) {
+      if (conn->stream_chunked)
+        sb_push_sv(sb, SV("0" CRLF CRLF));
+      http_stream_free(stream);
+      http_connection_settle(conn);
+    }
+  }
+}
+
+// File body due next, once the bytes before it are written
+HttpBodySlice *http_connection_file_due(const HttpConnection *conn) {
+  if (conn->body_index == conn->bodies.length) {
+    return NULL;
+  }
+  HttpBodySlice *slice = &conn->bodies.items[conn->body_index];
+  if (slice->file == NULL || conn->response_written < slice->offset) {
+    return NULL;
+  }
+  return slice;
+}
+
+HttpError http_connection_flush(HttpConnection *conn) {
+  while (http_connection_write_pending(conn)) {
+    ssize_t n;
+    const HttpBodySlice *file = http_connection_file_due(conn);
+    if (file != NULL) {
+      off_t offset = (off_t)(file->file_offset + conn->body_written);
+      n = sendfile(conn->fd, file->file->fd, &offset, file->body.length - conn->body_written);
+      if (n == 0) {
+        ERROR("sendfile failed: %s was truncated", file->file->path);
+        return HttpErrorWrite;
+      }
+    } else {
+      // sendmsg rather than writev to pass MSG_NOSIGNAL
+      struct iovec iov[HTTP_IOV_MAX];
+      struct msghdr msg = {0};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = http_connection_iov(conn, iov, HTTP_IOV_MAX);
+      n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return HttpErrorNil;
+      }
+      if (errno == ECONNRESET || errno == EPIPE) {
+        return HttpErrorConnectionReset;
+      }
+      ERROR("write failed: %s", strerror(errno));
+      return HttpErrorWrite;
+    }
+    http_connection_advance(conn, n);
+  }
+  return HttpErrorNil;
+}
+
+// Connection header options win, otherwise HTTP/1.1 defaults to keep alive
+bool http_request_keep_alive(const HttpRequest *request) {
+  StringPair p = sv_split_delim(http_request_known_header(request, HTTP_HEADER_CONNECTION), ',');
+  while (p.first.length > 0) {
+    String option = sv_trim(p.first);
+    if (sv_equal_ignore_case(option, SV("close")))
+      return false;
+    if (sv_equal_ignore_case(option, SV("keep-alive")))
+      return true;
+    p = sv_split_delim(p.second, ',');
+  }
+  return !sv_equal(request->proto, SV("HTTP/1.0"));
+}
+
+// "/static" matches "/static" and "/static/x" but not "/staticfoo"
+bool http_path_has_prefix(String path, String prefix) {
+  if (path.length < prefix.length || memcmp(path.items, prefix.items, prefix.length) != 0) {
+    return false;
+  }
+  return path.length == prefix.length || prefix.length == 0 ||
+         prefix.items[prefix.length - 1] == '/' || path.items[prefix.length] == '/';
+}
+
+// Serves the request from the first static route matching its path
+bool http_static_route(const HttpServer *server, const HttpRequest *request,
+                       HttpResponse *response) {
+  String path = sv_split_delim(request->path, '?').first;
+  for (size_t i = 0; i < server->static_routes.length; i++) {
+    const HttpStaticRoute *route = &server->static_routes.items[i];
+    if (!http_path_has_prefix(path, route->prefix)) {
+      continue;
+    }
+    // Root and rest are joined with exactly one '/', either may carry one
+    String root = route->root;
+    while (root.length > 0 && root.items[root.length - 1] == '/')
+      root.length--;
+    String rest = SV2(path.items + route->prefix.length, path.length - route->prefix.length);
+    while (rest.length > 0 && rest.items[0] == '/')
+      rest = SV2(rest.items + 1, rest.length - 1);
+
+    if (!sv_equal(request->method, SV("GET")) && !sv_equal(request->method, SV("HEAD"))) {
+      *response = http_status_response(405);
+      http_headers_set(&response->headers, SV("Allow"), SV("GET, HEAD"));
+    } else if (sv_find(rest, "..") >= 0 || memchr(rest.items, 0, rest.length) != NULL) {
+      *response = http_status_response(404);
+    } else if (rest.length == 0 || rest.items[rest.length - 1] == '/') {
+      *response = http_file_response(
+          tprintf(SV_Fmt "/" SV_Fmt "index.html", SV_Arg(root), SV_Arg(rest)));
+    } else {
+      *response = http_file_response(tprintf(SV_Fmt "/" SV_Fmt, SV_Arg(root), SV_Arg(rest)));
+    }
+    return true;
+  }
+  return false;
+}
+
+// Response cache
+#define HTTP_CACHE_BUCKETS 256
+
+atomic_ulong http_cache_hits = 0;
+atomic_ulong http_cache_misses = 0;
+atomic_ulong http_cache_stores = 0;
+atomic_ulong http_cache_evictions = 0;
+atomic_ulong http_cache_coalesced = 0;
+
+HttpCacheStats http_cache_stats(void) {
+  return (HttpCacheStats){
+      .hits = atomic_load_explicit(&http_cache_hits, memory_order_relaxed),
+      .misses = atomic_load_explicit(&http_cache_misses, memory_order_relaxed),
+      .stores = atomic_load_explicit(&http_cache_stores, memory_order_relaxed),
+      .evictions = atomic_load_explicit(&http_cache_evictions, memory_order_relaxed),
+      .coalesced = atomic_load_explicit(&http_cache_coalesced, memory_order_relaxed),
+  };
+}
+
+uint64_t http_cache_hash(String key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.length; i++) {
+    hash ^= (unsigned char)key.items[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Rule for a GET that can be answered from the cache, otherwise NULL
+const HttpCacheRule *http_cache_rule(const HttpServer *server, const HttpRequest *request) {
+  if (server->cache_rules.length == 0 || !sv_equal(request->method, SV("GET"))) {
+    return NULL;
+  }
+  // Validators and ranges are answered per request
+  if (http_request_known_header(request, HTTP_HEADER_RANGE).length > 0 ||
+      http_request_known_header(request, HTTP_HEADER_IF_NONE_MATCH).length > 0 ||
+      http_request_known_header(request, HTTP_HEADER_IF_MODIFIED_SINCE).length > 0) {
+    return NULL;
+  }
+
+  const String path = sv_split_delim(request->path, '?').first;
+  for (size_t i = 0; i < server->cache_rules.length; i++) {
+    if (http_path_has_prefix(path, server->cache_rules.items[i].prefix))
+      return &server->cache_rules.items[i];
+  }
+  return NULL;
+}
+
+// Method, full path and each vary header value on its own line
+String http_cache_key(const HttpRequest *request, const HttpCacheRule *rule) {
+  StringBuilder sb = {0};
+  sb_push_sv(&sb, request->method);
+  sb_push_char(&sb, ' ');
+  sb_push_sv(&sb, request->path);
+  StringPair p = sv_split_delim((rule != NULL) ? rule->vary : StringNil, ',');
+  while (p.first.length > 0 || p.second.length > 0) {
+    const String name = sv_trim(p.first);
+    if (name.length > 0) {
+      sb_push_char(&sb, '\n');
+      sb_push_sv(&sb, http_request_header(request, name));
+    }
+    p = sv_split_delim(p.second, ',');
+  }
+  return sb_to_sv(&sb);
+}
+
+void http_cache_unlink(HttpResponseCache *cache, HttpCacheEntry *entry) {
+  if (entry->newer != NULL)
+    entry->newer->older = entry->older;
+  else
+    cache->newest = entry->older;
+  if (entry->older != NULL)
+    entry->older->newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+  entry->newer = NULL;
+  entry->older = NULL;
+}
+
+void http_cache_push_newest(HttpResponseCache *cache, HttpCacheEntry *entry) {
+  entry->older = cache->newest;
+  if (cache->newest != NULL)
+    cache->newest->newer = entry;
+  cache->newest = entry;
+  if (cache->oldest == NULL)
+    cache->oldest = entry;
+}
+
+void http_cache_remove(HttpResponseCache *cache, HttpCacheEntry *entry) {
+  HttpCacheEntry **slot = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+  while (*slot != entry) {
+    slot = &(*slot)->chain;
+  }
+  *slot = entry->chain;
+  http_cache_unlink(cache, entry);
+  cache->entries--;
+  cache->size -= sizeof(HttpCacheEntry) + entry->key_length + entry->length;
+  free(entry);
+  atomic_fetch_add_explicit(&http_cache_evictions, 1, memory_order_relaxed);
+}
+
+HttpCacheEntry *http_cache_lookup(HttpResponseCache *cache, String key, uint64_t hash) {
+  if (cache->buckets == NULL) {
+    return NULL;
+  }
+
+  HttpCacheEntry *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+  while (entry != NULL && (entry->hash != hash || entry->key_length != key.length ||
+                           memcmp(entry->data, key.items, key.length) != 0)) {
+    entry = entry->chain;
+  }
+  if (entry == NULL) {
+    return NULL;
+  }
+  if (http_now_ms() >= entry->expires_ms) {
+    http_cache_remove(cache, entry);
+    return NULL;
+  }
+
+  http_cache_unlink(cache, entry);
+  http_cache_push_newest(cache, entry);
+  return entry;
+}
+
+void http_cache_grow(HttpResponseCache *cache) {
+  const size_t count = (cache->bucket_count == 0) ? HTTP_CACHE_BUCKETS : cache->bucket_count * 2;
+  HttpCacheEntry **buckets = calloc(count, sizeof(HttpCacheEntry *));
+  assert(buckets != NULL);
+  for (size_t i = 0; i < cache->bucket_count; i++) {
+    HttpCacheEntry *entry = cache->buckets[i];
+    while (entry != NULL) {
+      HttpCacheEntry *next = entry->chain;
+      entry->chain = buckets[entry->hash & (count - 1)];
+      buckets[entry->hash & (count - 1)] = entry;
+      entry = next;
+    }
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->bucket_count = count;
+}
+
+// Response encoded without its Connection and Date lines or its per request
+// headers, for the response cache and coalesced requests
+typedef struct {
+  String data;
+  size_t split; // End of the status line, where Connection and Date go
+} HttpEncodedResponse;
+
+HttpEncodedResponse http_response_encode_shared(const HttpResponse *response) {
+  StringBuilder sb = {0};
+  http_response_encode_status(response, &sb);
+  const size_t split = sb.length;
+  http_response_encode_fields(response, &sb);
+  sb_push_sv(&sb, response->body);
+  return (HttpEncodedResponse){sb_to_sv(&sb), split};
+}
+
+// request_headers are the ones of the request it now answers
+void http_encoded_response_emit(HttpEncodedResponse encoded, bool keep_alive,
+                                const HashTable *request_headers, StringBuilder *sb) {
+  sb_push_sv(sb, SV2(encoded.data.items, encoded.split));
+  http_response_encode_connection(keep_alive, sb);
+  http_headers_encode(request_headers, sb);
+  sb_push_sv(sb, SV2(encoded.data.items + encoded.split, encoded.data.length - encoded.split));
+}
+
+void http_cache_store(HttpResponseCache *cache, String key, uint64_t hash, long ttl_ms,
+                      HttpEncodedResponse encoded) {
+  // Large responses would churn everything else out
+  const size_t size = sizeof(HttpCacheEntry) + key.length + encoded.data.length;
+  if (size > cache->capacity / 8) {
+    return;
+  }
+
+  HttpCacheEntry *existing = http_cache_lookup(cache, key, hash);
+  if (existing != NULL) {
+    http_cache_remove(cache, existing);
+  }
+  while (cache->oldest != NULL && cache->size + size > cache->capacity) {
+    http_cache_remove(cache, cache->oldest);
+  }
+  if (cache->entries >= cache->bucket_count) {
+    http_cache_grow(cache);
+  }
+
+  HttpCacheEntry *entry = malloc(size);
+  assert(entry != NULL);
+  *entry = (HttpCacheEntry){0};
+  entry->hash = hash;
+  entry->expires_ms = http_now_ms() + ttl_ms;
+  entry->key_length = key.length;
+  entry->split = encoded.split;
+  entry->length = encoded.data.length;
+  memcpy(entry->data, key.items, key.length);
+  memcpy(entry->data + key.length, encoded.data.items, encoded.data.length);
+
+  HttpCacheEntry **bucket = &cache->buckets[hash & (cache->bucket_count - 1)];
+  entry->chain = *bucket;
+  *bucket = entry;
+  http_cache_push_newest(cache, entry);
+  cache->entries++;
+  cache->size += size;
+  atomic_fetch_add_explicit(&http_cache_stores, 1, memory_order_relaxed);
+}
+
+void http_cache_emit(const HttpCacheEntry *entry, bool keep_alive, const HashTable *request_headers,
+                     StringBuilder *sb) {
+  const HttpEncodedResponse encoded = {SV2((char *)entry->data + entry->key_length, entry->length), entry->split};
+  http_encoded_response_emit(encoded, keep_alive, request_headers, sb);
+}
+
+// Per request headers for a response the callback never saw, allocated
+// from the current arena
+HashTable http_request_decorate(const HttpServer *server, const HttpRequest *request) {
+  HashTable headers = {0};
+  if (server->decorate != NULL) {
+    server->decorate(request, &headers);
+  }
+  return headers;
+}
+
+// Request coalescing
+// Identical requests on different workers share one handler run. Followers
+// park their connection with the request left buffered, the rest of their
+// worker carries on, and are woken like a deferred once the leader is done.
+typedef struct HttpFlight {
+  struct HttpFlight *chain;
+  uint64_t hash;
+  String key;
+  int refs;
+  bool done;
+  bool shared;    // encoded can be copied, otherwise waiters run the handler
+  bool cacheable; // encoded may also go to the followers' caches
+  HttpEncodedResponse encoded;
+  HttpDeferred *waiters; // Parked followers, woken by http_flight_finish
+} HttpFlight;
+
+#define HTTP_FLIGHT_BUCKETS 64
+
+pthread_mutex_t http_flights_lock = PTHREAD_MUTEX_INITIALIZER;
+HttpFlight *http_flights[HTTP_FLIGHT_BUCKETS] = {0};
+
+bool http_coalesce_rule(const HttpServer *server, const HttpRequest *request) {
+  if (server->coalesce_prefixes.length == 0 || !sv_equal(request->method, SV("GET"))) {
+    return false;
+  }
+  // Responses to these depend on more than the key, or on who is asking.
+  // Followers also parse their request again once woken, which a consumed
+  // body can't take.
+  if (request->body_length > 0 || request->body_fd >= 0 ||
+      http_request_known_header(request, HTTP_HEADER_RANGE).length > 0 ||
+      http_request_known_header(request, HTTP_HEADER_IF_NONE_MATCH).length > 0 ||
+      http_request_known_header(request, HTTP_HEADER_IF_MODIFIED_SINCE).length > 0 ||
+      http_request_known_header(request, HTTP_HEADER_AUTHORIZATION).length > 0 ||
+      http_request_known_header(request, HTTP_HEADER_COOKIE).length > 0) {
+    return false;
+  }
+
+  const String path = sv_split_delim(request->path, '?').first;
+  for (size_t i = 0; i < server->coalesce_prefixes.length; i++) {
+    if (http_path_has_prefix(path, server->coalesce_prefixes.items[i]))
+      return true;
+  }
+  return false;
+}
+
+// Joins the flight for key, leader is set when the caller has to run it
+HttpFlight *http_flight_join(String key, uint64_t hash, bool *leader) {
+  pthread_mutex_lock(&http_flights_lock);
+  HttpFlight **bucket = &http_flights[hash % HTTP_FLIGHT_BUCKETS];
+  HttpFlight *flight = *bucket;
+  while (flight != NULL && (flight->hash != hash || !sv_equal(flight->key, key))) {
+    flight = flight->chain;
+  }
+
+  *leader = flight == NULL;
+  if (flight == NULL) {
+    flight = malloc(sizeof(HttpFlight));
+    assert(flight != NULL);
+    *flight = (HttpFlight){0};
+    flight->hash = hash;
+    flight->key = SV2(malloc(key.length), key.length);
+    assert(flight->key.items != NULL);
+    memcpy(flight->key.items, key.items, key.length);
+    flight->chain = *bucket;
+    *bucket = flight;
+  }
+  flight->refs++;
+  pthread_mutex_unlock(&http_flights_lock);
+  return flight;
+}
+
+void http_flight_release(HttpFlight *flight) {
+  pthread_mutex_lock(&http_flights_lock);
+  const bool last = --flight->refs == 0;
+  pthread_mutex_unlock(&http_flights_lock);
+
+  if (last) {
+    free(flight->key.items);
+    free(flight->encoded.data.items);
+    free(flight);
+  }
+}
+
+// Parks a follower's connection until the leader is done, false when it
+// already is. The connection keeps its reference to the flight either way.
+bool http_flight_park(HttpEventLoop *loop, HttpConnection *conn, HttpFlight *flight) {
+  HttpDeferred *deferred = calloc(1, sizeof(HttpDeferred));
+  assert(deferred != NULL);
+  deferred->loop = loop;
+  deferred->conn = conn;
+  deferred->request.body_fd = -1;
+
+  pthread_mutex_lock(&http_flights_lock);
+  const bool parked = !flight->done;
+  if (parked) {
+    deferred->flight = flight;
+    deferred->next = flight->waiters;
+    flight->waiters = deferred;
+  }
+  pthread_mutex_unlock(&http_flights_lock);
+
+  if (!parked) {
+    free(deferred);
+    return false;
+  }
+  conn->deferred = deferred;
+  return true;
+}
+
+// Publishes the leader's response, taking ownership of encoded
+void http_flight_finish(HttpFlight *flight, HttpEncodedResponse encoded, bool shared,
+                        bool cacheable) {
+  pthread_mutex_lock(&http_flights_lock);
+  HttpFlight **slot = &http_flights[flight->hash % HTTP_FLIGHT_BUCKETS];
+  while (*slot != flight) {
+    slot = &(*slot)->chain;
+  }
+  *slot = flight->chain; // Later requests start a new flight
+  flight->encoded = encoded;
+  flight->shared = shared;
+  flight->cacheable = cacheable;
+  flight->done = true;
+  HttpDeferred *waiter = flight->waiters;
+  flight->waiters = NULL;
+  pthread_mutex_unlock(&http_flights_lock);
+
+  while (waiter != NULL) {
+    HttpDeferred *next = waiter->next;
+    http_deferred_wake(waiter);
+    waiter = next;
+  }
+  http_flight_release(flight);
+}
+
+// Queues the body after its encoded headers, copying it unless it is large
+// and outlives the request
+void http_connection_queue_file(HttpConnection *conn, HttpFile *file, size_t offset, size_t length) {
+  if (length == 0) {
+    return;
+  }
+  file->refs++; // Released once written
+  HttpBodySlice slice = {conn->response_sb.length, SV2(NULL, length), false, file, offset};
+  array_append(&conn->bodies, slice);
+  conn->body_pending += length;
+}
+
+void http_connection_queue_body(HttpEventLoop *loop, HttpConnection *conn,
+                                HttpResponse *response) {
+  if (response->stream.produce != NULL) {
+    // Produced as the socket drains, the head goes out first
+    conn->stream = response->stream;
+    conn->stream_chunked = response->keep_alive;
+    response->stream = (HttpStream){0};
+    return;
+  }
+
+  if (response->status_code == 206) {
+    const HttpRanges *ranges = &response->ranges;
+    for (size_t i = 0; i < ranges->length; i++) {
+      const HttpRange *range = &ranges->items[i];
+      if (ranges->length > 1) {
+        sb_push_sv(&conn->response_sb, http_range_part_header(response, i));
+      }
+      if (response->file != NULL) {
+        http_connection_queue_file(conn, response->file, range->start, range->end - range->start + 1);
+      } else {
+        sb_push_sv(&conn->response_sb, SV2(response->body.items + range->start, range->end - range->start + 1));
+      }
+    }
+    if (ranges->length > 1) {
+      sb_push_sv(&conn->response_sb, http_range_part_end(response));
+    }
+    return;
+  }
+
+  if (response->file != NULL) {
+    http_connection_queue_file(conn, response->file, 0, response->file->size);
+    return;
+  }
+
+  const String body = response->body;
+  const bool outlives = response->static_body || response->free_body_after_use;
+  if (body.length < HTTP_WRITEV_MIN_BODY || !outlives ||
+      arena_owns(&loop->arena, body.items)) {
+    sb_push_sv(&conn->response_sb, body);
+    return;
+  }
+
+  HttpBodySlice slice = {conn->response_sb.length, body, response->free_body_after_use, NULL, 0};
+  array_append(&conn->bodies, slice);
+  conn->body_pending += body.length;
+  response->free_body_after_use = false; // Freed once written
+}
+
+// Answers status and closes, the rest of the request is never read
+void http_connection_reject(HttpConnection *conn, int status) {
+  HttpResponse response = http_status_response(status);
+  response.keep_alive = false;
+  http_response_encode(&response, &conn->response_sb);
+  conn->keep_alive = false;
+  if (conn->body_fd >= 0) {
+    close(conn->body_fd);
+    conn->body_fd = -1;
+  }
+}
+
+// Unlinked from the start so nothing is left behind on a crash
+int http_spill_open(String dir) {
+  const char *path = tprintf(SV_Fmt, SV_Arg(dir)).items;
+  int fd = open(path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+    // Filesystem without O_TMPFILE
+    char *name = tprintf("%s/http-body-XXXXXX", path).items;
+    fd = mkostemp(name, O_CLOEXEC);
+    if (fd >= 0)
+      unlink(name);
+  }
+  if (fd < 0) {
+    ERROR("body spill file in %s: %s", path, strerror(errno));
+  }
+  return fd;
+}
+
+// Drops the chunk framing consumed so far and when spilling moves the
+// decoded bytes to the spill file, leaving only the undecoded tail buffered
+bool http_connection_trim_body(HttpConnection *conn, size_t start, String spill_dir, bool spill) {
+  HttpParser *parser = &conn->parser;
+  StringBuilder *sb = &conn->request_sb;
+  char *body = sb->items + start + parser->header_length;
+  size_t keep = parser->body_length;
+
+  if (spill && keep > 0) {
+    if (conn->body_fd < 0) {
+      conn->body_fd = http_spill_open(spill_dir);
+      if (conn->body_fd < 0) {
+        return false;
+      }
+    }
+    size_t written = 0;
+    while (written < keep) {
+      const ssize_t n = write(conn->body_fd, body + written, keep - written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        ERROR("body spill failed: %s", strerror(errno));
+        return false;
+      }
+      written += n;
+    }
+    conn->body_spilled += keep;
+    keep = 0;
+  }
+
+  const size_t drop = parser->body_scanned - keep;
+  if (drop > 0) {
+    const size_t tail = sb->length - (start + parser->header_length + parser->body_scanned);
+    memmove(body + keep, body + parser->body_scanned, tail);
+    sb->length -= drop;
+    sb->items[sb->length] = 0;
+  }
+  parser->body_scanned = parser->body_length = keep;
+  return true;
+}
+
+bool http_parser_expects_continue(const HttpParser *parser, String raw) {
+  for (size_t i = 0; i < parser->header_count; i++) {
+    if (parser->headers[i].id == HTTP_HEADER_EXPECT) {
+      return sv_equal_ignore_case(http_span_sv(raw, parser->headers[i].value), SV("100-continue"));
+    }
+  }
+  return false;
+}
+
+// Enforces the header and body limits on the request starting at start,
+// spilling its body once it outgrows memory. request is set once the
+// request is complete and then gets the spill file. Returns the status to
+// refuse the request with, or 0.
+int http_connection_receive(HttpEventLoop *loop, HttpConnection *conn, size_t start,
+                            HttpRequest *request) {
+  const HttpServerInitOptions *options = &loop->server->options;
+  HttpParser *parser = &conn->parser;
+  const StringBuilder *sb = &conn->request_sb;
+  if (!parser->headers_done) {
+    return (sb->length - start > HTTP_MAX_HEADER_SIZE) ? 431 : 0;
+  }
+  if (parser->header_length > HTTP_MAX_HEADER_SIZE) {
+    return 431;
+  }
+
+  const bool can_spill = options->body_spill_dir.length > 0;
+  const size_t limit = can_spill ? options->max_body_size : options->max_body_memory;
+  if (parser->content_length > limit || conn->body_spilled + parser->body_length > limit) {
+    return 413;
+  }
+
+  // Spilled in batches while receiving, the rest once complete
+  const bool spilling = can_spill && (conn->body_fd >= 0 ||
+                                      parser->content_length > options->max_body_memory ||
+                                      parser->body_length > options->max_body_memory);
+  const bool spill = spilling && (request != NULL || parser->body_length >= HTTP_BODY_READ_SIZE);
+  if (!http_connection_trim_body(conn, start, options->body_spill_dir, spill)) {
+    return 500;
+  }
+
+  if (request == NULL) {
+    if (!parser->continued && http_parser_expects_continue(parser, SV2(sb->items + start, sb->length - start))) {
+      sb_push_sv(&conn->response_sb, SV("HTTP/1.1 100 Continue" CRLF CRLF));
+      parser->continued = true;
+    }
+    return 0;
+  }
+
+  // Framing and spilled bytes are gone from the buffer
+  request->raw_request.length = parser->header_length + parser->body_scanned;
+  request->body = SV2(request->raw_request.items + parser->header_length, parser->body_length);
+  request->body_length = parser->body_length;
+  if (conn->body_fd >= 0) {
+    request->body = StringNil;
+    request->body_fd = conn->body_fd;
+    request->body_length = conn->body_spilled;
+    conn->body_fd = -1;
+    conn->body_spilled = 0;
+  }
+  return 0;
+}
+
+// Queues a completed deferred response in place of the request it answers
+void http_connection_emit_deferred(HttpConnection *conn) {
+  HttpDeferred *deferred = conn->deferred;
+  sb_push_sv(&conn->response_sb, sb_to_sv(&deferred->encoded));
+  if (deferred->stream.produce != NULL) {
+    conn->stream = deferred->stream;
+    conn->stream_chunked = deferred->stream_chunked;
+    deferred->stream = (HttpStream){0};
+  }
+  conn->keep_alive = deferred->keep_alive;
+  conn->deferred = NULL;
+  http_deferred_free(deferred);
+}
+
+// Closes the spill file once the request is answered
+void http_request_body_free(HttpRequest *request) {
+  if (request->body_fd >= 0) {
+    close(request->body_fd);
+    request->body_fd = -1;
+  }
+}
+
+// Loop running a handler on this thread, for http_defer
+_Thread_local HttpEventLoop *http_current_loop = NULL;
+
+// Set by http_defer_finish, for http_defer
+_Thread_local struct {
+  HttpDeferFinish finish;
+  const void *state;
+  size_t size;
+} http_current_finish = {0};
+
+void http_defer_finish(HttpDeferFinish finish, const void *state, size_t size) {
+  http_current_finish.finish = finish;
+  http_current_finish.state = state;
+  http_current_finish.size = size;
+}
+
+// Runs the callback for every complete (possibly pipelined) request buffered
+// on the connection, responses are queued on response_sb for the caller to
+// write in one go
+HttpError http_connection_process(HttpEventLoop *loop, HttpConnection *conn) {
+  StringBuilder *sb = &conn->request_sb;
+  size_t consumed = 0;
+  HttpError err = HttpErrorNil;
+
+  // A parked follower's request is first in the buffer, it is answered
+  // from the flight it joined
+  HttpFlight *landed = NULL;
+  if (conn->deferred != NULL) {
+    if (!conn->deferred->ready) {
+      return HttpErrorNil;
+    }
+    if (conn->deferred->flight != NULL) {
+      landed = conn->deferred->flight;
+      conn->deferred->flight = NULL;
+      http_deferred_free(conn->deferred);
+      conn->deferred = NULL;
+    } else {
+      http_connection_emit_deferred(conn);
+    }
+  }
+
+  // Pipelined requests wait once enough responses are queued, until a
+  // streamed body is complete or until a deferred response is completed
+  while (conn->keep_alive && consumed < sb->length && conn->stream.produce == NULL &&
+         conn->deferred == NULL && http_connection_queued(conn) < HTTP_PIPELINE_MAX_PENDING) {
+    TempMark mark = tmark();
+    HttpRequest request = {0};
+    err = http_parse_request(&conn->parser, SV2(sb->items + consumed, sb->length - consumed), &request);
+    if (err == HttpErrorParse) {
+      // Where the next request would start is unknown, so it's the last
+      http_connection_reject(conn, 400);
+      http_parser_reset(&conn->parser);
+      consumed = sb->length;
+      err = HttpErrorNil;
+      trewind(mark);
+      break;
+    }
+    if (err != HttpErrorNil && err != HttpErrorIncomplete) {
+      trewind(mark);
+      break;
+    }
+    const int refused = http_connection_receive(loop, conn, consumed, (err == HttpErrorNil) ? &request : NULL);
+    if (refused != 0) {
+      http_connection_reject(conn, refused);
+      http_parser_reset(&conn->parser);
+      consumed = sb->length;
+      err = HttpErrorNil;
+      trewind(mark);
+      break;
+    }
+    if (err == HttpErrorIncomplete) {
+      err = HttpErrorNil;
+      trewind(mark);
+      break;
+    }
+    http_parser_reset(&conn->parser);
+    conn->request_started_ms = 0;
+
+    // Over budget the pre-encoded 503 is sent and the connection closed
+    // without running the handler. Without a budget nothing is counted so
+    // workers don't contend on the counter.
+    const int max_in_flight = loop->server->options.max_in_flight;
+    if (max_in_flight > 0 && !conn->in_flight) {
+      if (!http_budget_acquire(&http_requests_in_flight, max_in_flight)) {
+        atomic_fetch_add_explicit(&http_requests_shed, 1, memory_order_relaxed);
+        sb_push_sv(&conn->response_sb, loop->overloaded);
+        conn->keep_alive = false;
+        http_request_body_free(&request);
+        consumed = sb->length;
+        trewind(mark);
+        break;
+      }
+      conn->in_flight = true;
+    }
+
+    if (landed == NULL) {
+      INFO("request received: " SV_Fmt, SV_Arg(http_request_to_string(request)));
+    }
+
+    // Handler allocations come from the loop arena, the encoded response
+    // goes to the heap backed connection buffer
+    request.arena = &loop->arena;
+    Arena *previous = arena_set_current(&loop->arena);
+    const HttpCacheRule *cache_rule = http_cache_rule(loop->server, &request);
+    const bool coalesce = landed != NULL || http_coalesce_rule(loop->server, &request);
+    String key = StringNil;
+    uint64_t hash = 0;
+    if (cache_rule != NULL || coalesce) {
+      key = http_cache_key(&request, cache_rule);
+      hash = http_cache_hash(key);
+    }
+
+    if (cache_rule != NULL && landed == NULL) {
+      const HttpCacheEntry *entry = http_cache_lookup(&loop->cache, key, hash);
+      if (entry != NULL) {
+        const HashTable headers = http_request_decorate(loop->server, &request);
+        arena_set_current(previous);
+        atomic_fetch_add_explicit(&http_cache_hits, 1, memory_order_relaxed);
+        conn->keep_alive = http_request_keep_alive(&request);
+        http_cache_emit(entry, conn->keep_alive, &headers, &conn->response_sb);
+        http_request_body_free(&request);
+        arena_reset(&loop->arena);
+        trewind(mark);
+        consumed += request.raw_request.length;
+        continue;
+      }
+      atomic_fetch_add_explicit(&http_cache_misses, 1, memory_order_relaxed);
+    }
+
+    HttpFlight *flight = landed;
+    bool follower = landed != NULL;
+    landed = NULL;
+    if (coalesce && flight == NULL) {
+      bool leader;
+      flight = http_flight_join(key, hash, &leader);
+      follower = !leader;
+      if (follower && http_flight_park(loop, conn, flight)) {
+        // Left buffered for when the leader is done
+        arena_set_current(previous);
+        arena_reset(&loop->arena);
+        trewind(mark);
+        break;
+      }
+    }
+    if (follower) {
+      if (flight->shared) {
+        const HashTable headers = http_request_decorate(loop->server, &request);
+        arena_set_current(previous);
+        atomic_fetch_add_explicit(&http_cache_coalesced, 1, memory_order_relaxed);
+        conn->keep_alive = http_request_keep_alive(&request);
+        http_encoded_response_emit(flight->encoded, conn->keep_alive, &headers, &conn->response_sb);
+        if (cache_rule != NULL && flight->cacheable) {
+          http_cache_store(&loop->cache, key, hash, cache_rule->ttl_ms, flight->encoded);
+        }
+        http_flight_release(flight);
+        http_request_body_free(&request);
+        arena_reset(&loop->arena);
+        trewind(mark);
+        consumed += request.raw_request.length;
+        continue;
+      }
+      http_flight_release(flight);
+      flight = NULL;
+    }
+
+    HttpResponse response;
+    if (!http_static_route(loop->server, &request, &response)) {
+      http_current_loop = loop;
+      response = loop->callback(&request);
+      http_current_loop = NULL;
+    }
+    if (response.deferred != NULL) {
+      // The request now lives in the deferred, the placeholder holds nothing
+      arena_set_current(previous);
+      if (flight != NULL) {
+        http_flight_finish(flight, (HttpEncodedResponse){0}, false, false);
+      }
+      response.deferred->conn = conn;
+      conn->deferred = response.deferred;
+      arena_reset(&loop->arena);
+      trewind(mark);
+      consumed += request.raw_request.length;
+      continue;
+    }
+    http_response_conditional(&request, &response);
+    arena_set_current(previous);
+
+    if (!http_request_keep_alive(&request)) {
+      response.keep_alive = false;
+    }
+    // HTTP/1.0 has no chunked encoding, closing ends the body
+    const bool streamed = response.stream.produce != NULL;
+    if (streamed && sv_equal(request.proto, SV("HTTP/1.0"))) {
+      response.keep_alive = false;
+    }
+    http_response_encode_head(&response, &conn->response_sb);
+    if (!sv_equal(request.method, SV("HEAD"))) {
+      http_connection_queue_body(loop, conn, &response);
+    }
+
+    const bool storable = response.status_code == 200 && !response.no_store;
+    const bool cacheable = cache_rule != NULL && storable && response.file == NULL && !streamed;
+    // A failure is shared with the requests that waited on it, but not kept
+    const bool shared = flight != NULL && response.file == NULL && !streamed && !response.no_store;
+    HttpEncodedResponse encoded = {0};
+    if (cacheable || shared) {
+      encoded = http_response_encode_shared(&response);
+    }
+    if (cacheable) {
+      http_cache_store(&loop->cache, key, hash, cache_rule->ttl_ms, encoded);
+    }
+    if (flight != NULL) {
+      http_flight_finish(flight, encoded, shared, storable);
+    } else {
+      free(encoded.data.items);
+    }
+
+    // Cleanup, heap allocations made outside of the arena are still freed
+    previous = arena_set_current(&loop->arena);
+    if (response.free_body_after_use)
+      MEM_FREE(response.body.items);
+    if (response.file != NULL)
+      http_file_release(response.file);
+    http_stream_free(&response.stream); // HEAD requests never start it
+    http_headers_free(&response.headers);
+    http_headers_free(&response.request_headers);
+    arena_set_current(previous);
+    http_request_body_free(&request);
+    arena_reset(&loop->arena);
+    trewind(mark);
+
+    conn->keep_alive = response.keep_alive;
+    consumed += request.raw_request.length;
+  }
+
+  // Carry leftover bytes of the next request to the front
+  if (consumed > 0) {
+    memmove(sb->items, sb->items + consumed, sb->length - consumed);
+    sb->length -= consumed;
+  }
+
+  return err;
+}
+
+void http_timer_cancel(HttpTimerWheel *wheel, HttpConnection *conn) {
+  if (conn->timer_pprev == NULL) {
+    return;
+  }
+  *conn->timer_pprev = conn->timer_next;
+  if (conn->timer_next != NULL) {
+    conn->timer_next->timer_pprev = conn->timer_pprev;
+  }
+  conn->timer_next = NULL;
+  conn->timer_pprev = NULL;
+  conn->deadline_ms = 0;
+  wheel->count--;
+}
+
+void http_timer_set(HttpTimerWheel *wheel, HttpConnection *conn, long deadline_ms) {
+  if (conn->deadline_ms == deadline_ms) {
+    return;
+  }
+  http_timer_cancel(wheel, conn);
+
+  // Rounded up so the deadline has passed when its tick is expired,
+  // already due ones expire on the next tick
+  long tick = (deadline_ms + HTTP_TIMER_TICK_MS - 1) / HTTP_TIMER_TICK_MS;
+  if (tick < wheel->tick) {
+    tick = wheel->tick;
+  }
+  HttpConnection **slot = &wheel->slots[tick & (HTTP_TIMER_SLOTS - 1)];
+  conn->timer_next = *slot;
+  conn->timer_pprev = slot;
+  if (*slot != NULL) {
+    (*slot)->timer_pprev = &conn->timer_next;
+  }
+  *slot = conn;
+  conn->deadline_ms = deadline_ms;
+  wheel->count++;
+}
+
+// Picks the deadline for what the connection is waiting on. Any event
+// counts as progress except while the headers are incomplete, so a client
+// dribbling its headers is cut off no matter how often it sends.
+void http_connection_arm_timer(HttpEventLoop *loop, HttpConnection *conn) {
+  const HttpServerInitOptions *options = &loop->server->options;
+  const long now = loop->now_ms;
+  long deadline = 0;
+  if (http_connection_write_pending(conn) || conn->stream.produce != NULL) {
+    if (options->idle_timeout_ms > 0)
+      deadline = now + options->idle_timeout_ms;
+  } else if (conn->deferred != NULL) {
+    // Up to whoever completes it
+  } else if (conn->parser.headers_done) {
+    if (options->body_timeout_ms > 0)
+      deadline = now + options->body_timeout_ms;
+  } else {
+    if (conn->request_started_ms == 0 && conn->request_sb.length > 0) {
+      conn->request_started_ms = now;
+    }
+    if (conn->request_started_ms != 0) {
+      if (options->header_timeout_ms > 0)
+        deadline = conn->request_started_ms + options->header_timeout_ms;
+    } else if (options->idle_timeout_ms > 0) {
+      deadline = now + options->idle_timeout_ms;
+    }
+  }
+
+  if (deadline == 0) {
+    http_timer_cancel(&loop->timers, conn);
+  } else {
+    http_timer_set(&loop->timers, conn, deadline);
+  }
+}
+
+void http_uring_connection_close(HttpEventLoop *loop, HttpConnection *conn);
+
+// Closed without a response, a client this slow isn't waiting for one
+void http_connection_on_timeout(HttpEventLoop *loop, HttpConnection *conn) {
+  if (loop->uring) {
+    http_uring_connection_close(loop, conn);
+  } else {
+    http_connection_free(conn);
+  }
+}
+
+// Expires every connection due by now
+void http_timer_advance(HttpEventLoop *loop) {
+  HttpTimerWheel *wheel = &loop->timers;
+  const long now_tick = loop->now_ms / HTTP_TIMER_TICK_MS;
+  if (now_tick - wheel->tick > HTTP_TIMER_SLOTS) {
+    wheel->tick = now_tick - HTTP_TIMER_SLOTS; // One turn visits every slot
+  }
+
+  for (; wheel->tick <= now_tick; wheel->tick++) {
+    HttpConnection *conn = wheel->slots[wheel->tick & (HTTP_TIMER_SLOTS - 1)];
+    while (conn != NULL) {
+      HttpConnection *next = conn->timer_next;
+      if (conn->deadline_ms <= loop->now_ms) {
+        http_timer_cancel(wheel, conn);
+        http_connection_on_timeout(loop, conn);
+      }
+      conn = next;
+    }
+  }
+}
+
+// Returns false once the connection should be closed
+bool http_connection_fill(HttpEventLoop *loop, HttpConnection *conn) {
+  const HttpError err = http_connection_read(conn, http_read_limit(loop->server));
+  if (err == HttpErrorEOF) {
+    conn->eof = true;
+  } else if (err == HttpErrorConnectionReset) {
+    return false;
+  } else if (err != HttpErrorNil) {
+    ERROR("http read failed: " SV_Fmt, SV_Arg(http_error_to_string(err)));
+    return false;
+  }
+  return true;
+}
+
+// Returns false once the connection should be closed
+bool http_connection_on_event(HttpEventLoop *loop, HttpConnection *conn,
+                              uint32_t events) {
+  if (events & EPOLLERR) {
+    return false;
+  }
+
+  HttpError err = HttpErrorNil;
+  if (events & EPOLLOUT) {
+    err = http_connection_flush(conn);
+    if (err != HttpErrorNil) {
+      return false;
+    }
+  }
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+    if (!http_connection_fill(loop, conn)) {
+      return false;
+    }
+  }
+
+  // Until nothing more can be handled or the socket stops taking writes
+  while (true) {
+    const size_t buffered = conn->request_sb.length;
+    const bool streaming = conn->stream.produce != NULL;
+    err = http_connection_process(loop, conn);
+    if (err != HttpErrorNil) {
+      ERROR("http parse request failed: " SV_Fmt, SV_Arg(http_error_to_string(err)));
+      return false;
+    }
+
+    http_connection_stream(conn);
+    err = http_connection_flush(conn);
+    if (err != HttpErrorNil) {
+      return false;
+    }
+
+    // The socket took everything, keep producing until it pushes back and
+    // once a stream ends go on with the requests pipelined behind it
+    if (http_connection_write_pending(conn)) {
+      break;
+    }
+    // Reading paused at the buffer limit goes on once requests are consumed
+    if (conn->read_paused && conn->request_sb.length < http_read_limit(loop->server)) {
+      if (!http_connection_fill(loop, conn)) {
+        return false;
+      }
+      continue;
+    }
+    if (!streaming && conn->stream.produce == NULL && conn->request_sb.length == buffered) {
+      break;
+    }
+  }
+
+  // Wait for EPOLLOUT to finish writing, or for the deferred response
+  if (http_connection_write_pending(conn) || conn->deferred != NULL) {
+    return true;
+  }
+  return conn->keep_alive && !conn->eof;
+}
+
+Error http_event_loop_add(HttpEventLoop *loop, int client_fd) {
+  HttpConnection *conn = http_connection_new(client_fd);
+
+  // Edge triggered, connection is drained on every wakeup
+  struct epoll_event ev = {0};
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = conn;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+    http_connection_free(conn);
+    return errorf("epoll_ctl failed: %s", strerror(errno));
+  }
+
+  return ErrorNil;
+}
+
+// Connections wait in the backlog while paused, the listener stays
+// registered but stops reporting
+void http_event_loop_pause_accept(HttpEventLoop *loop, long retry_ms) {
+  struct epoll_event ev = {0};
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->listen_fd, &ev);
+  loop->accept_paused = true;
+  loop->accept_retry_ms = loop->now_ms + retry_ms;
+}
+
+void http_event_loop_resume_accept(HttpEventLoop *loop) {
+  if (loop->now_ms < loop->accept_retry_ms ||
+      !http_budget_available(&http_connections_open, loop->server->options.max_connections)) {
+    return;
+  }
+  struct epoll_event ev = {0};
+  ev.events = EPOLLIN;
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->listen_fd, &ev);
+  loop->accept_paused = false;
+}
+
+// Accepts on the loop's own listener until the backlog is drained
+void http_event_loop_accept(HttpEventLoop *loop) {
+  const int max = loop->server->options.max_connections;
+  while (true) {
+    if (!http_budget_available(&http_connections_open, max)) {
+      http_event_loop_pause_accept(loop, 0);
+      return;
+    }
+    const int client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EMFILE || errno == ENFILE) {
+        WARN("accept paused: %s", strerror(errno));
+        http_event_loop_pause_accept(loop, HTTP_TIMER_TICK_MS);
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        ERROR("accept failed: %s", strerror(errno));
+      }
+      return;
+    }
+    // Other loops may have taken the last ones since the check
+    if (!http_budget_acquire(&http_connections_open, max)) {
+      http_connection_shed(client_fd, loop->overloaded);
+      continue;
+    }
+
+    Error err = http_event_loop_add(loop, client_fd);
+    if (has_error(err)) {
+      ERROR(SV_Fmt, SV_Arg(err.message));
+    }
+  }
+}
+
+void http_uring_connection_next(HttpEventLoop *loop, HttpConnection *conn);
+
+// Picks up the connections whose deferred responses were completed
+void http_event_loop_resume_deferred(HttpEventLoop *loop) {
+  pthread_mutex_lock(&loop->deferred_lock);
+  HttpDeferred *deferred = loop->deferred_done;
+  loop->deferred_done = NULL;
+  pthread_mutex_unlock(&loop->deferred_lock);
+
+  while (deferred != NULL) {
+    HttpDeferred *next = deferred->next;
+    deferred->ready = true;
+    HttpConnection *conn = deferred->conn;
+    if (conn == NULL) {
+      http_deferred_free(deferred); // Its connection has closed
+    } else if (loop->uring) {
+      http_uring_connection_next(loop, conn);
+    } else if (!http_connection_on_event(loop, conn, 0)) {
+      http_timer_cancel(&loop->timers, conn);
+      http_connection_free(conn);
+    } else {
+      http_connection_arm_timer(loop, conn);
+    }
+    deferred = next;
+  }
+}
+
+void *http_event_loop_run(void *arg) {
+  HttpEventLoop *loop = arg;
+  struct epoll_event events[HTTP_MAX_EVENTS];
+
+  while (true) {
+    const bool ticking = loop->timers.count > 0 || loop->accept_paused;
+    const int timeout = ticking ? HTTP_TIMER_TICK_MS : -1;
+    const int n = epoll_wait(loop->epoll_fd, events, HTTP_MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERROR("epoll_wait failed: %s", strerror(errno));
+      break;
+    }
+    loop->now_ms = http_now_ms();
+
+    for (int i = 0; i < n; i++) {
+      // Listener is registered without a connection
+      if (events[i].data.ptr == NULL) {
+        http_event_loop_accept(loop);
+        continue;
+      }
+      if (events[i].data.ptr == &loop->wake_fd) {
+        uint64_t count;
+        while (read(loop->wake_fd, &count, sizeof(count)) > 0) {
+        }
+        loop->woken = true;
+        continue;
+      }
+
+      HttpConnection *conn = events[i].data.ptr;
+      if (!http_connection_on_event(loop, conn, events[i].events)) {
+        http_timer_cancel(&loop->timers, conn);
+        http_connection_free(conn);
+        continue;
+      }
+      http_connection_arm_timer(loop, conn);
+    }
+
+    // After the batch so no event refers to a connection closed here
+    if (loop->woken) {
+      loop->woken = false;
+      http_event_loop_resume_deferred(loop);
+    }
+    http_timer_advance(loop);
+    if (loop->accept_paused) {
+      http_event_loop_resume_accept(loop);
+    }
+  }
+
+  return NULL;
+}
+
+// io_uring backend: one ring per loop, multishot accept, recv from a provided
+// buffer ring and send linked to the follow up recv
+
+#define HTTP_URING_OP_ACCEPT 0
+#define HTTP_URING_OP_RECV 1
+#define HTTP_URING_OP_SEND 2
+#define HTTP_URING_OP_TIMEOUT 3
+#define HTTP_URING_OP_CANCEL 4
+#define HTTP_URING_OP_WAKE 5
+#define HTTP_URING_OP_MASK 7 // Connections come from malloc, aligned to at least 8
+
+uint64_t http_uring_user_data(HttpConnection *conn, int op) {
+  return (uint64_t)(uintptr_t)conn | op;
+}
+
+void http_uring_prep_accept(HttpEventLoop *loop) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  assert(sqe != NULL);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = http_uring_user_data(NULL, HTTP_URING_OP_ACCEPT);
+  loop->accept_armed = true;
+}
+
+// Cancels the multishot accept, connections wait in the backlog while paused
+void http_uring_pause_accept(HttpEventLoop *loop, long retry_ms) {
+  loop->accept_retry_ms = loop->now_ms + retry_ms;
+  if (loop->accept_paused) {
+    return;
+  }
+  loop->accept_paused = true;
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  assert(sqe != NULL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = http_uring_user_data(NULL, HTTP_URING_OP_ACCEPT);
+  sqe->user_data = http_uring_user_data(NULL, HTTP_URING_OP_CANCEL);
+}
+
+void http_uring_resume_accept(HttpEventLoop *loop) {
+  if (loop->now_ms < loop->accept_retry_ms ||
+      !http_budget_available(&http_connections_open, loop->server->options.max_connections)) {
+    return;
+  }
+  loop->accept_paused = false;
+  // Otherwise the cancel is still on its way and re-arms it on completion
+  if (!loop->accept_armed) {
+    http_uring_prep_accept(loop);
+  }
+}
+
+void http_uring_prep_recv(HttpEventLoop *loop, HttpConnection *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  assert(sqe != NULL);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->len = loop->buf_ring.buffer_size;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = loop->buf_ring.bgid;
+  sqe->user_data = http_uring_user_data(conn, HTTP_URING_OP_RECV);
+  conn->recv_armed = true;
+  conn->inflight++;
+}
+
+void http_uring_prep_send(HttpEventLoop *loop, HttpConnection *conn, bool link) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  assert(sqe != NULL);
+  conn->msg = (struct msghdr){0};
+  conn->msg.msg_iov = conn->iov;
+  conn->msg.msg_iovlen = http_connection_iov(conn, conn->iov, HTTP_IOV_MAX);
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = http_uring_user_data(conn, HTTP_URING_OP_SEND);
+  if (link) {
+    sqe->flags = IOSQE_IO_LINK;
+  }
+  conn->send_inflight = true;
+  conn->inflight++;
+}
+
+void http_uring_connection_close(HttpEventLoop *loop, HttpConnection *conn) {
+  if (!conn->closing) {
+    http_timer_cancel(&loop->timers, conn);
+    conn->closing = true;
+    // Completes any armed recv so the connection can be released
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+  if (conn->inflight == 0) {
+    http_connection_free(conn);
+  }
+}
+
+// Receiving pauses at the buffer limit until requests are consumed
+bool http_uring_recv_paused(const HttpEventLoop *loop, const HttpConnection *conn) {
+  return conn->request_sb.length >= http_read_limit(loop->server);
+}
+
+// io_uring has no sendfile, so the file body due next is read a window at
+// a time into file_buf as the socket drains. False when the file came up
+// short, the rest of the response can't be sent.
+bool http_uring_read_file(HttpConnection *conn) {
+  const HttpBodySlice *slice = http_connection_file_due(conn);
+  if (slice == NULL || conn->body_written < conn->file_buf_start + conn->file_buf_length) {
+    return true;
+  }
+  if (conn->file_buf == NULL) {
+    conn->file_buf = malloc(HTTP_STREAM_WINDOW);
+    assert(conn->file_buf != NULL);
+  }
+
+  const size_t left = slice->body.length - conn->body_written;
+  const size_t want = (left < HTTP_STREAM_WINDOW) ? left : HTTP_STREAM_WINDOW;
+  const off_t offset = (off_t)(slice->file_offset + conn->body_written);
+  size_t got = 0;
+  while (got < want) {
+    const ssize_t n = pread(slice->file->fd, conn->file_buf + got, want - got, offset + (off_t)got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    got += n;
+  }
+  if (got < want) {
+    ERROR("read failed: %s was truncated", slice->file->path);
+    return false;
+  }
+  conn->file_buf_start = conn->body_written;
+  conn->file_buf_length = want;
+  return true;
+}
+
+// Decides what to submit next after a completion
+void http_uring_connection_next(HttpEventLoop *loop, HttpConnection *conn) {
+  if (conn->closing) {
+    http_uring_connection_close(loop, conn);
+    return;
+  }
+
+  // response_sb and the queued bodies must not move while a send is in flight
+  if (!conn->send_inflight) {
+    if (!http_connection_write_pending(conn)) {
+      const HttpError err = http_connection_process(loop, conn);
+      if (err != HttpErrorNil) {
+        ERROR("http parse request failed: " SV_Fmt, SV_Arg(http_error_to_string(err)));
+        http_uring_connection_close(loop, conn);
+        return;
+      }
+    }
+    http_connection_stream(conn);
+    if (!http_uring_read_file(conn)) {
+      http_uring_connection_close(loop, conn);
+      return;
+    }
+
+    const bool wants_recv = conn->keep_alive && !conn->eof;
+    if (http_connection_write_pending(conn)) {
+      const bool link = wants_recv && !conn->recv_armed && !http_uring_recv_paused(loop, conn);
+      http_uring_prep_send(loop, conn, link);
+      if (link) {
+        http_uring_prep_recv(loop, conn);
+      }
+      http_connection_arm_timer(loop, conn);
+      return;
+    }
+    if (!wants_recv) {
+      // A deferred response is still written, see http_event_loop_resume_deferred
+      if (conn->deferred != NULL) {
+        http_connection_arm_timer(loop, conn);
+      } else {
+        http_uring_connection_close(loop, conn);
+      }
+      return;
+    }
+  }
+
+  if (!conn->recv_armed && !http_uring_recv_paused(loop, conn)) {
+    http_uring_prep_recv(loop, conn);
+  }
+  http_connection_arm_timer(loop, conn);
+}
+
+void http_uring_on_accept(HttpEventLoop *loop, const struct io_uring_cqe *cqe) {
+  const int max = loop->server->options.max_connections;
+  if (cqe->res >= 0) {
+    // Completions already queued when the accept was paused land here
+    if (!http_budget_acquire(&http_connections_open, max)) {
+      http_connection_shed(cqe->res, loop->overloaded);
+      http_uring_pause_accept(loop, 0);
+    } else {
+      HttpConnection *conn = http_connection_new(cqe->res);
+      http_uring_prep_recv(loop, conn);
+      http_connection_arm_timer(loop, conn);
+      if (!http_budget_available(&http_connections_open, max)) {
+        http_uring_pause_accept(loop, 0);
+      }
+    }
+  } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+    WARN("accept paused: %s", strerror(-cqe->res));
+    http_uring_pause_accept(loop, HTTP_TIMER_TICK_MS);
+  } else if (cqe->res != -ECANCELED) {
+    ERROR("accept failed: %s", strerror(-cqe->res));
+  }
+
+  // Multishot accept was terminated, arm it again unless paused
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    loop->accept_armed = false;
+    if (!loop->accept_paused) {
+      http_uring_prep_accept(loop);
+    }
+  }
+}
+
+void http_uring_on_recv(HttpEventLoop *loop, HttpConnection *conn,
+                        const struct io_uring_cqe *cqe) {
+  conn->inflight--;
+  conn->recv_armed = false;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    const unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0 && !conn->closing) {
+      sb_push_sv(&conn->request_sb, SV2(uring_buf_ring_get(&loop->buf_ring, bid), cqe->res));
+    }
+    uring_buf_ring_recycle(&loop->buf_ring, bid);
+  }
+
+  if (cqe->res == 0) {
+    conn->eof = true;
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+    // ENOBUFS is retried by the next recv, ECANCELED means the linked send failed
+    http_uring_connection_close(loop, conn);
+    return;
+  }
+
+  http_uring_connection_next(loop, conn);
+}
+
+void http_uring_on_send(HttpEventLoop *loop, HttpConnection *conn,
+                        const struct io_uring_cqe *cqe) {
+  conn->inflight--;
+  conn->send_inflight = false;
+
+  if (cqe->res < 0) {
+    if (cqe->res != -EPIPE && cqe->res != -ECONNRESET && !conn->closing) {
+      ERROR("write failed: %s", strerror(-cqe->res));
+    }
+    http_uring_connection_close(loop, conn);
+    return;
+  }
+
+  http_connection_advance(conn, cqe->res);
+
+  http_uring_connection_next(loop, conn);
+}
+
+// A single relative timeout per ring drives the timer wheel while any
+// connection has a timer set
+void http_uring_prep_timeout(HttpEventLoop *loop) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  assert(sqe != NULL);
+  loop->timeout = (struct __kernel_timespec){.tv_nsec = HTTP_TIMER_TICK_MS * 1000000L};
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)&loop->timeout;
+  sqe->len = 1;
+  sqe->user_data = http_uring_user_data(NULL, HTTP_URING_OP_TIMEOUT);
+  loop->timeout_armed = true;
+}
+
+// Reads the eventfd signalled when deferred responses are completed
+void http_uring_prep_wake(HttpEventLoop *loop) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  assert(sqe != NULL);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = loop->wake_fd;
+  sqe->addr = (uint64_t)(uintptr_t)&loop->wake_count;
+  sqe->len = sizeof(loop->wake_count);
+  sqe->user_data = http_uring_user_data(NULL, HTTP_URING_OP_WAKE);
+}
+
+void *http_uring_loop_run(void *arg) {
+  HttpEventLoop *loop = arg;
+  http_uring_prep_accept(loop);
+  http_uring_prep_wake(loop);
+
+  while (true) {
+    const bool ticking = loop->timers.count > 0 || loop->accept_paused;
+    if (ticking && !loop->timeout_armed) {
+      http_uring_prep_timeout(loop);
+    }
+    if (uring_submit_and_wait(&loop->ring, 1) < 0 && errno != EBUSY) {
+      ERROR("io_uring_enter failed: %s", strerror(errno));
+      break;
+    }
+    loop->now_ms = http_now_ms();
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+      const struct io_uring_cqe completion = *cqe;
+      uring_cqe_seen(&loop->ring);
+
+      HttpConnection *conn =
+          (HttpConnection *)(uintptr_t)(completion.user_data & ~(uint64_t)HTTP_URING_OP_MASK);
+      switch (completion.user_data & HTTP_URING_OP_MASK) {
+      case HTTP_URING_OP_ACCEPT:
+        http_uring_on_accept(loop, &completion);
+        break;
+      case HTTP_URING_OP_RECV:
+        http_uring_on_recv(loop, conn, &completion);
+        break;
+      case HTTP_URING_OP_SEND:
+        http_uring_on_send(loop, conn, &completion);
+        break;
+      case HTTP_URING_OP_TIMEOUT:
+        loop->timeout_armed = false;
+        break;
+      case HTTP_URING_OP_CANCEL:
+        break;
+      case HTTP_URING_OP_WAKE:
+        loop->woken = true;
+        http_uring_prep_wake(loop);
+        break;
+      }
+    }
+
+    if (loop->woken) {
+      loop->woken = false;
+      http_event_loop_resume_deferred(loop);
+    }
+
+    http_timer_advance(loop);
+    if (loop->accept_paused) {
+      http_uring_resume_accept(loop);
+    }
+  }
+
+  return NULL;
+}
+
+// Multishot accept and provided buffer rings need Linux 5.19
+bool http_uring_supported(void) {
+  Uring ring;
+  if (has_error(uring_init(&ring, 2))) {
+    return false;
+  }
+
+  UringBufRing buf_ring;
+  const bool ok = !has_error(uring_buf_ring_init(&ring, &buf_ring, 1, 1, 0));
+  if (ok) {
+    uring_buf_ring_free(&ring, &buf_ring);
+  }
+  uring_free(&ring);
+  return ok;
+}
+
+typedef ARRAY(int) CpuList;
+
+// Parses a kernel cpulist e.g. "0-3,8-11"
+void http_parse_cpulist(String sv, CpuList *cpus) {
+  StringPair p = sv_split_delim(sv_trim(sv), ',');
+  while (p.first.length > 0) {
+    StringPair range = sv_split_delim(p.first, '-');
+    char *endptr;
+    const int lo = sv_to_int(range.first, &endptr);
+    const int hi = (range.second.length > 0) ? sv_to_int(range.second, &endptr) : lo;
+    for (int cpu = lo; cpu <= hi; cpu++) {
+      array_append(cpus, cpu);
+    }
+    p = sv_split_delim(p.second, ',');
+  }
+}
+
+// CPUs the process may run on, grouped node by node when numa is set so that
+// neighbouring workers share a memory node
+CpuList http_worker_cpus(bool numa) {
+  CpuList cpus = {0};
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    return cpus;
+  }
+
+  if (numa) {
+    for (int node = 0;; node++) {
+      String path = tprintf("/sys/devices/system/node/node%d/cpulist", node);
+      if (!file_exists(path.items)) {
+        break;
+      }
+
+      StringBuilder sb = {0};
+      CpuList node_cpus = {0};
+      if (!has_error(read_entire_file(path.items, &sb))) {
+        http_parse_cpulist(sb_to_sv(&sb), &node_cpus);
+      }
+      for (size_t i = 0; i < node_cpus.length; i++) {
+        const int cpu = node_cpus.items[i];
+        if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+          array_append(&cpus, cpu);
+          CPU_CLR(cpu, &allowed); // Already placed
+        }
+      }
+      array_free(&node_cpus);
+      sb_free(&sb);
+    }
+  }
+
+  // CPUs without node information (or numa disabled) in numeric order
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      array_append(&cpus, cpu);
+    }
+  }
+
+  return cpus;
+}
+
+Error http_event_loop_start(HttpEventLoop *loop) {
+  void *(*run)(void *) = http_event_loop_run;
+  if (loop->uring) {
+    Error err = uring_init(&loop->ring, HTTP_URING_ENTRIES);
+    if (has_error(err)) {
+      return err;
+    }
+    err = uring_buf_ring_init(&loop->ring, &loop->buf_ring, HTTP_URING_BUFFERS,
+                              HTTP_READ_BUFFER_SIZE, 0);
+    if (has_error(err)) {
+      return err;
+    }
+    run = http_uring_loop_run;
+  } else {
+    if (loop->listen_fd >= 0) {
+      struct epoll_event ev = {0};
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;
+      if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+        return errorf("epoll_ctl failed: %s", strerror(errno));
+      }
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &loop->wake_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+      return errorf("epoll_ctl failed: %s", strerror(errno));
+    }
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (loop->cpu >= 0) {
+    // Pinned before start so the loop's memory is first touched on its node
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(loop->cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+
+  const int rc = pthread_create(&loop->tid, &attr, run, loop);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    return errorf("pthread_create failed: %s", strerror(rc));
+  }
+
+  return ErrorNil;
+}
+
+Error http_server_listen(const HttpServer *server, const HttpListenCallback callback) {
+  assert(server != NULL);
+  assert(server->sock_fd > 0);
+  assert(callback != NULL);
+
+  const HttpServerInitOptions *opt = &server->options;
+  if (listen(server->sock_fd, opt->backlog) < 0) {
+    return errorf("listen failed: %s\n", strerror(errno));
+  }
+
+  CpuList cpus = {0};
+  if (opt->pin_workers) {
+    cpus = http_worker_cpus(opt->numa_aware);
+  }
+
+  bool uring = opt->io_backend == HTTP_IO_URING;
+  if (uring && !http_uring_supported()) {
+    WARN("io_uring is not supported by the kernel, falling back to epoll");
+    uring = false;
+  }
+
+  const String overloaded = http_overloaded_response(opt->retry_after);
+  const int workers = opt->workers;
+  HttpEventLoop *loops = malloc(workers * sizeof(HttpEventLoop));
+  assert(loops != NULL);
+
+  for (int i = 0; i < workers; i++) {
+    HttpEventLoop *loop = &loops[i];
+    *loop = (HttpEventLoop){0};
+    loop->callback = callback;
+    loop->server = server;
+    loop->overloaded = overloaded;
+    loop->cache.capacity = opt->response_cache_size;
+    loop->uring = uring;
+    loop->listen_fd = -1;
+    loop->cpu = (cpus.length > 0) ? cpus.items[i % cpus.length] : -1;
+    loop->epoll_fd = -1;
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+      return errorf("eventfd failed: %s", strerror(errno));
+    }
+    pthread_mutex_init(&loop->deferred_lock, NULL);
+    if (!uring) {
+      loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      if (loop->epoll_fd < 0) {
+        return errorf("epoll_create1 failed: %s", strerror(errno));
+      }
+    }
+
+    if (opt->shard_listeners) {
+      // The kernel spreads connections across the SO_REUSEPORT group
+      loop->listen_fd = server->sock_fd;
+      if (i > 0) {
+        struct sockaddr_in addr = {0};
+        Error err = http_server_bind(opt->port, &loop->listen_fd, &addr);
+        if (has_error(err)) {
+          return err;
+        }
+        if (listen(loop->listen_fd, opt->backlog) < 0) {
+          return errorf("listen failed: %s\n", strerror(errno));
+        }
+      }
+      fcntl(loop->listen_fd, F_SETFL, fcntl(loop->listen_fd, F_GETFL) | O_NONBLOCK);
+    } else if (uring) {
+      // Every ring keeps a multishot accept on the shared listener
+      loop->listen_fd = server->sock_fd;
+    }
+
+    Error err = http_event_loop_start(loop);
+    if (has_error(err)) {
+      return err;
+    }
+  }
+  array_free(&cpus);
+
+  INFO("server started with %d %s workers%s%s", workers,
+       uring ? "io_uring" : "epoll",
+       opt->shard_listeners ? ", sharded listeners" : "",
+       opt->pin_workers ? ", pinned" : "");
+
+  // Loops accept on their own
+  if (opt->shard_listeners || uring) {
+    for (int i = 0; i < workers; i++) {
+      pthread_join(loops[i].tid, NULL);
+    }
+    assert(false && "unreachable");
+  }
+
+  size_t next_loop = 0;
+  const struct timespec pause = {.tv_nsec = HTTP_ACCEPT_PAUSE_MS * 1000000L};
+  while (true) {
+    // Over the budget connections wait in the backlog
+    if (!http_budget_available(&http_connections_open, opt->max_connections)) {
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    const int client_fd = accept4(server->sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      ERROR("accept failed: %s\n", strerror(errno));
+      if (errno == EMFILE || errno == ENFILE) {
+        nanosleep(&pause, NULL);
+      }
+      continue;
+    }
+    if (!http_budget_acquire(&http_connections_open, opt->max_connections)) {
+      http_connection_shed(client_fd, overloaded);
+      continue;
+    }
+
+    // Round robin, connections stay on the loop they were assigned to
+    HttpEventLoop *loop = &loops[next_loop++ % workers];
+    Error err = http_event_loop_add(loop, client_fd);
+    if (has_error(err)) {
+      ERROR(SV_Fmt, SV_Arg(err.message));
+    }
+  }
+
+  assert(false && "unreachable");
+}
+
+void http_server_free(const HttpServer *server) {
+  close(server->sock_fd);
+  array_free(&server->static_routes);
+  array_free(&server->cache_rules);
+  array_free(&server->coalesce_prefixes);
+}
+
+void http_server_cache(HttpServer *server, String prefix, long ttl_ms, String vary) {
+  assert(server != NULL);
+  HttpCacheRule rule = {prefix, ttl_ms, vary};
+  array_append(&server->cache_rules, rule);
+}
+
+void http_server_coalesce(HttpServer *server, String prefix) {
+  assert(server != NULL);
+  array_append(&server->coalesce_prefixes, prefix);
+}
+
+void http_server_decorate(HttpServer *server, HttpDecorateCallback callback) {
+  assert(server != NULL);
+  server->decorate = callback;
+}
+
+void http_server_static(HttpServer *server, String prefix, String root) {
+  assert(server != NULL);
+  // Routes are matched in order, longer prefixes should come first
+  HttpStaticRoute route = {prefix, root};
+  array_append(&server->static_routes, route);
+}
+
+HttpBodyReader http_body_reader(const HttpRequest *request) {
+  return (HttpBodyReader){.request = request};
+}
+
+String http_body_read(HttpBodyReader *reader) {
+  const HttpRequest *request = reader->request;
+  if (reader->offset >= request->body_length) {
+    return StringNil;
+  }
+  if (request->body_fd < 0) {
+    reader->offset = request->body_length;
+    return request->body;
+  }
+
+  if (reader->buffer == NULL) {
+    reader->buffer = talloc(HTTP_BODY_READ_SIZE);
+  }
+  const size_t left = request->body_length - reader->offset;
+  const size_t size = (left < HTTP_BODY_READ_SIZE) ? left : HTTP_BODY_READ_SIZE;
+  ssize_t n;
+  do {
+    n = pread(request->body_fd, reader->buffer, size, (off_t)reader->offset);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    ERROR("body read failed: %s", (n < 0) ? strerror(errno) : "truncated");
+    return StringNil;
+  }
+  reader->offset += n;
+  return SV2(reader->buffer, n);
+}
+
+HttpResponse http_response_init(int status_code) {
+  HttpResponse response = {0};
+  response.status_code = status_code;
+  response.keep_alive = true;
+  response.free_body_after_use = false;
   return response;
 }
 
@@ -442,8 +3870,11 @@ HttpResponse http_json_response(const int status, JsonValue *json) {
   HttpResponse response = http_response_init(status);
   response.content_type = SV("application/json");
 
+  // Heap allocated so large bodies can be written after the arena is reset
+  Arena *arena = arena_set_current(NULL);
   StringBuilder sb = {0};
   json_encode(*json, &sb, 0);
+  arena_set_current(arena);
   response.body = sb_to_sv(&sb);
   response.free_body_after_use = true;
   json_free(json);
@@ -459,8 +3890,136 @@ HttpResponse http_text_response(const int status, String body) {
   return response;
 }
 
+HttpResponse http_file_response(String path) {
+  HttpFile *file = http_file_open(tprintf(SV_Fmt, SV_Arg(path)).items);
+  if (file == NULL) {
+    return http_status_response(404);
+  }
+
+  HttpResponse response = http_response_init(200);
+  response.content_type = file->content_type;
+  response.file = file;
+  response.etag = SV2(file->etag, strlen(file->etag));
+  response.last_modified = file->mtime;
+  response.accept_ranges = true;
+  return response;
+}
+
+HttpResponse http_stream_response(const int status, String content_type, HttpStream stream) {
+  HttpResponse response = http_response_init(status);
+  response.content_type = content_type;
+  response.stream = stream;
+  response.no_store = true;
+  return response;
+}
+
+// Strings of the copy that pointed into the request's raw bytes
+String http_deferred_rebase(String sv, String raw, char *copy) {
+  if (sv.items < raw.items || sv.items > raw.items + raw.length) {
+    return sv;
+  }
+  return SV2(copy + (sv.items - raw.items), sv.length);
+}
+
+HttpResponse http_defer(const HttpRequest *request, HttpDeferred **deferred) {
+  assert(http_current_loop != NULL && "http_defer is only for handlers");
+
+  HttpDeferred *d = calloc(1, sizeof(HttpDeferred));
+  assert(d != NULL);
+  d->loop = http_current_loop;
+
+  // Everything the request points to goes into one block
+  const String raw = request->raw_request;
+  d->raw = malloc(raw.length + request->request_id.length + 1);
+  assert(d->raw != NULL);
+  memcpy(d->raw, raw.items, raw.length);
+  memcpy(d->raw + raw.length, request->request_id.items, request->request_id.length);
+
+  HttpRequest *copy = &d->request;
+  *copy = *request;
+  copy->arena = NULL;
+  copy->request_id = SV2(d->raw + raw.length, request->request_id.length);
+  copy->proto = http_deferred_rebase(request->proto, raw, d->raw);
+  copy->method = http_deferred_rebase(request->method, raw, d->raw);
+  copy->path = http_deferred_rebase(request->path, raw, d->raw);
+  copy->body = http_deferred_rebase(request->body, raw, d->raw);
+  copy->raw_request = SV2(d->raw, raw.length);
+  for (size_t i = 0; i < copy->headers.length; i++) {
+    HttpHeader *header = &copy->headers.items[i];
+    header->key = http_deferred_rebase(header->key, raw, d->raw);
+    header->value = http_deferred_rebase(header->value, raw, d->raw);
+  }
+  // The spill file now belongs to the copy, closed along with the deferred
+
+  if (http_current_finish.finish != NULL) {
+    d->finish = http_current_finish.finish;
+    d->finish_state = malloc(http_current_finish.size);
+    assert(d->finish_state != NULL);
+    memcpy(d->finish_state, http_current_finish.state, http_current_finish.size);
+  }
+
+  *deferred = d;
+  HttpResponse response = http_response_init(0);
+  response.deferred = d;
+  return response;
+}
+
+const HttpRequest *http_deferred_request(const HttpDeferred *deferred) {
+  return &deferred->request;
+}
+
+void http_deferred_complete(HttpDeferred *deferred, HttpResponse response) {
+  assert(deferred != NULL);
+  assert(response.file == NULL && "file responses need the worker's file cache");
+  const HttpRequest *request = &deferred->request;
+  TempMark mark = tmark();
+
+  if (deferred->finish != NULL) {
+    deferred->finish(deferred->finish_state, request, &response);
+  }
+  http_response_conditional(request, &response);
+  if (!http_request_keep_alive(request)) {
+    response.keep_alive = false;
+  }
+  const bool streamed = response.stream.produce != NULL;
+  if (streamed && sv_equal(request->proto, SV("HTTP/1.0"))) {
+    response.keep_alive = false;
+  }
+
+  // Heap allocated whatever arena the caller has set, the worker frees it
+  Arena *previous = arena_set_current(NULL);
+  http_response_encode_head(&response, &deferred->encoded);
+  if (!sv_equal(request->method, SV("HEAD"))) {
+    if (streamed) {
+      deferred->stream = response.stream;
+      deferred->stream_chunked = response.keep_alive;
+      response.stream = (HttpStream){0};
+    } else {
+      http_response_encode_body(&response, &deferred->encoded);
+    }
+  }
+  arena_set_current(previous);
+  deferred->keep_alive = response.keep_alive;
+
+  if (response.free_body_after_use)
+    MEM_FREE(response.body.items);
+  http_stream_free(&response.stream);
+  http_headers_free(&response.headers);
+  http_headers_free(&response.request_headers);
+  trewind(mark);
+  http_deferred_wake(deferred);
+}
+
 HttpResponse http_status_response(const int status) {
   HttpResponse response = http_response_init(status);
   response.free_body_after_use = false;
   return response;
 }
+
+HttpResponse http_overloaded_status(void) {
+  assert(http_current_loop != NULL && "http_overloaded_status is only for handlers");
+  HttpResponse response = http_status_response(503);
+  http_headers_set(&response.headers, SV("Retry-After"),
+                   tprintf("%d", http_current_loop->server->options.retry_after));
+  return response;
+}
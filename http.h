@@ -4,63 +4,296 @@
 #include "basic.h"
 
 #include <netinet/in.h>
+#include <time.h>
+
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_RANGES 16 // More are answered with the full body
+#define HTTP_HEADER_INDEX_MIN 8   // Fewer headers are looked up linearly
+#define HTTP_HEADER_INDEX_SIZE 128 // Power of two, at least 2 * HTTP_MAX_HEADERS
+
+// Well known headers, tagged by the parser so lookups need no hashing
+typedef enum {
+  HTTP_HEADER_UNKNOWN,
+  HTTP_HEADER_HOST,
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_CONTENT_TYPE,
+  HTTP_HEADER_CONNECTION,
+  HTTP_HEADER_TRANSFER_ENCODING,
+  HTTP_HEADER_ACCEPT,
+  HTTP_HEADER_ACCEPT_ENCODING,
+  HTTP_HEADER_ACCEPT_LANGUAGE,
+  HTTP_HEADER_USER_AGENT,
+  HTTP_HEADER_COOKIE,
+  HTTP_HEADER_AUTHORIZATION,
+  HTTP_HEADER_CACHE_CONTROL,
+  HTTP_HEADER_IF_NONE_MATCH,
+  HTTP_HEADER_IF_MODIFIED_SINCE,
+  HTTP_HEADER_IF_RANGE,
+  HTTP_HEADER_RANGE,
+  HTTP_HEADER_REFERER,
+  HTTP_HEADER_ORIGIN,
+  HTTP_HEADER_EXPECT,
+  HTTP_HEADER_UPGRADE,
+  HTTP_HEADER_CONTENT_ENCODING,
+  HTTP_HEADER_X_FORWARDED_FOR,
+  HTTP_HEADER_X_REQUEST_ID,
+  HTTP_HEADER_DATE,
+  HTTP_HEADER_PRAGMA,
+  HTTP_HEADER_KEEP_ALIVE,
+  HTTP_HEADER_COUNT,
+} HttpHeaderId;
 
-// HTTP Server
 typedef struct {
-  int sock_fd;
-  struct sockaddr_in addr;
-} HttpServer;
+  String key;
+  String value;
+  HttpHeaderId id;
+} HttpHeader;
+
+// Request headers in arrival order, repeated keys appear once per line.
+// Keys and values point into raw_request, nothing is heap allocated.
+typedef struct {
+  size_t length;
+  HttpHeader items[HTTP_MAX_HEADERS];
+
+  // First line of every well known header, item index + 1, 0 if absent
+  unsigned char known[HTTP_HEADER_COUNT];
+
+  // Built on the first lookup when there are many headers
+  bool indexed;
+  unsigned char index[HTTP_HEADER_INDEX_SIZE]; // Item index + 1, 0 is empty
+} HttpHeaders;
 
 typedef struct {
   String request_id; // Temp allocated
   String proto;
   String method;
   String path;
-  String body;
-  
-  // Keys and Values are heap allocated strings which freed after use
-  // headers are multi key map e.g. foo: [bar, buz]
-  HashTable headers;
+  String body;        // Empty when spilled, http_body_read covers both
+  size_t body_length;
+  int body_fd;        // Unlinked temp file holding a spilled body, otherwise -1
+  HttpHeaders headers;
   String raw_request;
+  Arena *arena; // Released once the response is encoded
 } HttpRequest;
 
+// Pulls the body in pieces whether it is in memory or was spilled
+typedef struct {
+  const HttpRequest *request;
+  size_t offset;
+  char *buffer; // Temp allocated on the first read of a spilled body
+} HttpBodyReader;
+
+typedef struct HttpFile HttpFile; // Open file shared through the file cache
+
+typedef struct {
+  size_t start;
+  size_t end; // Inclusive
+} HttpRange;
+
+// Satisfiable byte ranges of a 206, or the length alone for a 416
+typedef struct {
+  HttpRange items[HTTP_MAX_RANGES];
+  size_t length;
+  size_t total;    // Length of the complete body
+  String boundary; // multipart/byteranges when there is more than one
+} HttpRanges;
+
+// Appends the next part of a streamed body to out, about max bytes, and
+// returns false once the body is complete. It runs on the worker whenever
+// the connection has room, so it must not block for long, and it has to
+// append something unless it returns false, otherwise the stream is
+// dropped and the connection closed.
+typedef bool (*HttpStreamProduce)(void *data, StringBuilder *out, size_t max);
+
+typedef struct {
+  HttpStreamProduce produce;
+  void (*free)(void *data); // Optional, called once the stream ends or is dropped
+  void *data;               // Heap allocated, outlives the request
+} HttpStream;
+
+typedef struct HttpDeferred HttpDeferred; // Response completed later, see http_defer
+
 typedef struct {
   int status_code;
   HashTable headers;
+  HashTable request_headers; // Only true of this request, left out of cached and coalesced copies
   String content_type;
   String body;
   bool free_body_after_use; // Will call MEM_FREE on body after use
+  bool static_body;         // Body outlives the connection, never copied
+  HttpFile *file;           // Sent with sendfile in place of body
+  String etag;              // Quoted, W/ prefixed when weak
+  time_t last_modified;     // 0 when unknown
+  bool no_store;            // Never kept by the response cache
+  bool accept_ranges;       // Range requests are served from body, always for files
+  HttpRanges ranges;
+  HttpStream stream;        // Body produced while writing, chunked, when set
+  HttpDeferred *deferred;   // Placeholder returned by http_defer
   bool keep_alive;          // Whether to keep the connection alive
 } HttpResponse;
 
 typedef HttpResponse (*HttpListenCallback)(const HttpRequest *);
+// Sets the request_headers of a response served without the listen
+// callback, from the response cache or another request's handler run
+typedef void (*HttpDecorateCallback)(const HttpRequest *request, HashTable *request_headers);
 
 #define HTTP_DEFAULT_PORT 8000
 #define HTTP_BACKLOG 1024
+#define HTTP_ACCEPT_PAUSE_MS 10 // How often a paused listener checks the connection budget
 #define HTTP_HEADER_CAPACITY 20
 #define HTTP_READ_BUFFER_SIZE 512
+#define HTTP_MAX_HEADER_SIZE (64 * 1024) // Larger header blocks are refused with 431
+#define HTTP_MAX_BODY_MEMORY (1024 * 1024) // Larger bodies are spilled or refused with 413
+#define HTTP_MAX_BODY_SIZE (1024 * 1024 * 1024) // Limit for spilled bodies
+#define HTTP_BODY_READ_SIZE (64 * 1024)
+#define HTTP_IDLE_TIMEOUT_MS 60000
+#define HTTP_HEADER_TIMEOUT_MS 10000
+#define HTTP_BODY_TIMEOUT_MS 30000
+#define HTTP_MAX_CONNECTIONS 10000
+#define HTTP_RETRY_AFTER 1 // Seconds, sent with the 503 answered when overloaded
+#define HTTP_DEFAULT_WORKERS 0 // One event loop per online CPU
+#define HTTP_MAX_EVENTS 256
+#define HTTP_PIPELINE_MAX_PENDING (64 * 1024) // Response bytes queued before pipelined requests wait
+#define HTTP_STREAM_WINDOW (64 * 1024) // Streamed bytes buffered before waiting for the socket
+#define HTTP_WRITEV_MIN_BODY (16 * 1024) // Smaller bodies are copied next to their headers
+#define HTTP_IOV_MAX 16
+#define HTTP_FILE_CACHE_SIZE 64 // Open files kept per worker
+#define HTTP_FILE_REVALIDATE 1   // Seconds before a cached file is checked for changes
+#define HTTP_RESPONSE_CACHE_SIZE (8 * 1024 * 1024) // Bytes per worker
+#define HTTP_URING_ENTRIES 1024
+#define HTTP_URING_BUFFERS 512 // Provided recv buffers per ring, power of two
 
 typedef ARRAY(String) HeaderValues;
 
+HttpBodyReader http_body_reader(const HttpRequest *request);
+String http_body_read(HttpBodyReader *reader); // StringNil at the end or on errors
+
+HttpHeaderId http_header_id(String key);
+String http_header_name(HttpHeaderId id);
+String http_request_header(const HttpRequest *request, String key); // First value or StringNil
+String http_request_known_header(const HttpRequest *request, HttpHeaderId id);
+
 HashTable http_headers_init(void);
 void http_headers_set(HashTable *headers, String key, String value);
 HeaderValues *http_headers_get(const HashTable *headers, String key);
 void http_headers_free(HashTable *headers);
 
+typedef enum {
+  HTTP_IO_EPOLL,
+  HTTP_IO_URING, // Falls back to epoll when the kernel lacks support
+} HttpIoBackend;
+
 typedef struct {
   int port;
   int backlog;
   int header_capacity;
+  int workers; // Number of event loop threads
+  bool shard_listeners; // One SO_REUSEPORT listening socket per worker
+  bool pin_workers;     // Pin each worker thread to its own CPU
+  bool numa_aware;      // Assign pinned CPUs node by node
+  HttpIoBackend io_backend;
+  size_t response_cache_size; // Per worker, used by routes added with http_server_cache
+  size_t max_body_memory;     // Request body bytes held in memory
+  size_t max_body_size;       // Request body limit when spilling
+  String body_spill_dir;      // Larger bodies go to a temp file here, empty to refuse them
+  // Connections are closed when these run out, 0 disables one
+  long idle_timeout_ms;   // Between requests on a kept alive connection, or while a write stalls
+  long header_timeout_ms; // From the first byte of a request to the end of its headers
+  long body_timeout_ms;   // Between reads while a request body arrives
+  // Load shedding, 0 disables a budget. Over budget requests are answered
+  // 503 with Retry-After without reaching the handler.
+  int max_connections; // Accepting pauses once this many are open
+  int max_in_flight;   // Requests handled but not completely written
+  int retry_after;     // Seconds
 } HttpServerInitOptions;
 
+// Files under root served for paths starting with prefix
+typedef struct {
+  String prefix;
+  String root;
+} HttpStaticRoute;
+
+typedef ARRAY(HttpStaticRoute) HttpStaticRoutes;
+
+// 200 responses to GETs under prefix are cached for ttl_ms, keyed by the
+// path and the request's values of the comma separated vary headers
+typedef struct {
+  String prefix;
+  long ttl_ms;
+  String vary;
+} HttpCacheRule;
+
+typedef ARRAY(HttpCacheRule) HttpCacheRules;
+
+typedef ARRAY(String) HttpPrefixes;
+
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stores;
+  unsigned long evictions; // Expired ones included
+  unsigned long coalesced; // Requests answered by another worker's handler run
+} HttpCacheStats;
+
+typedef struct {
+  long connections;   // Open right now
+  long in_flight;     // Requests handled but not completely written, with max_in_flight set
+  unsigned long shed; // Connections and requests answered 503 when over budget
+} HttpLoadStats;
+
+// HTTP Server
+typedef struct {
+  int sock_fd;
+  struct sockaddr_in addr;
+  HttpServerInitOptions options;
+  HttpStaticRoutes static_routes;
+  HttpCacheRules cache_rules;
+  HttpPrefixes coalesce_prefixes;
+  HttpDecorateCallback decorate;
+} HttpServer;
+
 Error http_server_init(HttpServer *server);
 HttpServerInitOptions http_server_init_defaults(void);
 Error http_server_init_opts(HttpServer *server, HttpServerInitOptions options);
 Error http_server_listen(const HttpServer *server, HttpListenCallback callback);
 void http_server_free(const HttpServer *server);
+void http_server_static(HttpServer *server, String prefix, String root); // Before listening
+void http_server_cache(HttpServer *server, String prefix, long ttl_ms, String vary); // Before listening
+// Concurrent identical GETs under prefix share a single handler run
+void http_server_coalesce(HttpServer *server, String prefix); // Before listening
+void http_server_decorate(HttpServer *server, HttpDecorateCallback callback); // Before listening
+HttpCacheStats http_cache_stats(void); // Summed over all workers
+HttpLoadStats http_load_stats(void);
 
 HttpResponse http_response_init(int status_code);
 HttpResponse http_json_response(int status, JsonValue *json);
 HttpResponse http_text_response(int status, String body);
 HttpResponse http_status_response(int status);
+// 503 with the server's Retry-After, for handlers shedding load
+HttpResponse http_overloaded_status(void);
+HttpResponse http_file_response(String path); // 404 unless a regular file
+HttpResponse http_stream_response(int status, String content_type, HttpStream stream);
+
+// Answers the request later from any thread. The handler returns the
+// placeholder as is and hands deferred over to whoever completes it, the
+// connection holds back its pipelined requests until then. Every deferred
+// must be completed exactly once, even when its connection has closed.
+HttpResponse http_defer(const HttpRequest *request, HttpDeferred **deferred);
+// Heap copy of the request, valid until the deferred is completed
+const HttpRequest *http_deferred_request(const HttpDeferred *deferred);
+// Finishes a deferred response the way the handler's callers would have,
+// on the completing thread before it is encoded. request is the copy.
+typedef void (*HttpDeferFinish)(void *state, const HttpRequest *request, HttpResponse *response);
+// Set on the worker around a handler call, NULL to clear. A response
+// deferred meanwhile gets its own copy of size bytes of state to finish.
+void http_defer_finish(HttpDeferFinish finish, const void *state, size_t size);
+// Encodes response on the calling thread, so it may point at that thread's
+// temp memory, and wakes the connection's worker to write it. File
+// responses are not supported, streams are produced on the worker.
+void http_deferred_complete(HttpDeferred *deferred, HttpResponse response);
+
+String http_etag(String body, bool weak); // Temp allocated
+// For handlers to answer 304 before producing the body
+bool http_request_not_modified(const HttpRequest *request, String etag, time_t last_modified);
 #endif
@@ -0,0 +1,176 @@
+#include "middleware.h"
+#include "basic.h"
+#include "http.h"
+#include "router.h"
+
+#include <time.h>
+
+void http_pipeline_init(HttpPipeline *pipeline, const HttpRouter *router) {
+  assert(pipeline != NULL);
+  assert(router != NULL);
+  *pipeline = (HttpPipeline){0};
+  pipeline->router = router;
+}
+
+void http_pipeline_use(HttpPipeline *pipeline, HttpMiddleware middleware) {
+  assert(pipeline != NULL);
+  assert(pipeline->length < HTTP_MAX_MIDDLEWARE);
+  pipeline->items[pipeline->length++] = middleware;
+}
+
+// Copied into a deferred response so the after hooks run once it's complete
+typedef struct {
+  const HttpPipeline *pipeline;
+  HttpContext ctx;
+} HttpPipelineRun;
+
+void http_pipeline_after(const HttpPipeline *pipeline, HttpContext *ctx, size_t ran) {
+  while (ran > 0) {
+    ran--;
+    const HttpMiddleware *middleware = &pipeline->items[ran];
+    if (middleware->after != NULL) {
+      middleware->after(ctx, middleware->data, &ctx->locals[ran]);
+    }
+  }
+}
+
+void http_pipeline_finish(void *state, const HttpRequest *request, HttpResponse *response) {
+  HttpPipelineRun *run = state;
+  run->ctx.request = request;
+  run->ctx.response = *response;
+  run->ctx.params.length = 0; // Pointed into the worker's buffer
+  http_pipeline_after(run->pipeline, &run->ctx, run->pipeline->length);
+  *response = run->ctx.response;
+}
+
+// Serves the route in the middle unless route is false
+void http_pipeline_around(HttpPipelineRun *run, bool route) {
+  const HttpPipeline *pipeline = run->pipeline;
+  HttpContext *ctx = &run->ctx;
+  ctx->params.length = 0;
+  memset(ctx->locals, 0, pipeline->length * sizeof(HttpMiddlewareLocal));
+
+  size_t ran = 0;
+  bool handled = false;
+  while (ran < pipeline->length) {
+    const HttpMiddleware *middleware = &pipeline->items[ran];
+    ran++;
+    if (middleware->before != NULL &&
+        !middleware->before(ctx, middleware->data, &ctx->locals[ran - 1])) {
+      handled = true;
+      break;
+    }
+  }
+  if (!handled && route) {
+    http_defer_finish(http_pipeline_finish, run, sizeof(*run));
+    ctx->response = http_router_serve(pipeline->router, ctx->request, &ctx->params);
+    http_defer_finish(NULL, NULL, 0);
+    if (ctx->response.deferred != NULL) {
+      return; // Finished by the thread completing it
+    }
+  }
+  http_pipeline_after(pipeline, ctx, ran);
+}
+
+HttpResponse http_pipeline_run(const HttpPipeline *pipeline, const HttpRequest *request) {
+  HttpPipelineRun run;
+  run.pipeline = pipeline;
+  run.ctx.request = request;
+  run.ctx.response = http_status_response(500); // A short circuit that forgot to answer
+  http_pipeline_around(&run, true);
+  return run.ctx.response;
+}
+
+void http_pipeline_decorate(const HttpPipeline *pipeline, const HttpRequest *request,
+                            HashTable *request_headers) {
+  HttpPipelineRun run;
+  run.pipeline = pipeline;
+  run.ctx.request = request;
+  run.ctx.response = http_status_response(200);
+  http_pipeline_around(&run, false);
+
+  *request_headers = run.ctx.response.request_headers;
+  if (run.ctx.response.free_body_after_use)
+    MEM_FREE(run.ctx.response.body.items);
+  http_headers_free(&run.ctx.response.headers);
+}
+
+void http_request_id_after(HttpContext *ctx, void *data, HttpMiddlewareLocal *local) {
+  String id = http_request_known_header(ctx->request, HTTP_HEADER_X_REQUEST_ID);
+  if (id.length == 0) {
+    id = ctx->request->request_id;
+  }
+  http_headers_set(&ctx->response.request_headers, SV("X-Request-Id"), id);
+}
+
+HttpMiddleware http_middleware_request_id(void) {
+  return (HttpMiddleware){.name = SV("request_id"), .after = http_request_id_after};
+}
+
+long http_timing_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool http_timing_before(HttpContext *ctx, void *data, HttpMiddlewareLocal *local) {
+  local->value = http_timing_now_us();
+  return true;
+}
+
+void http_timing_after(HttpContext *ctx, void *data, HttpMiddlewareLocal *local) {
+  const long elapsed = http_timing_now_us() - local->value;
+  // Temp allocated, the response is encoded before temp memory is rewound
+  http_headers_set(&ctx->response.request_headers, SV("Server-Timing"),
+                   tprintf("app;dur=%ld.%03ld", elapsed / 1000, elapsed % 1000));
+}
+
+HttpMiddleware http_middleware_timing(void) {
+  return (HttpMiddleware){
+      .name = SV("timing"),
+      .before = http_timing_before,
+      .after = http_timing_after,
+  };
+}
+
+// Preflights are OPTIONS requests naming the method they are asking for
+bool http_cors_before(HttpContext *ctx, void *data, HttpMiddlewareLocal *local) {
+  const HttpCorsOptions *options = data;
+  const HttpRequest *request = ctx->request;
+  if (!sv_equal(request->method, SV("OPTIONS")) ||
+      http_request_known_header(request, HTTP_HEADER_ORIGIN).length == 0 ||
+      http_request_header(request, SV("Access-Control-Request-Method")).length == 0) {
+    return true;
+  }
+
+  ctx->response = http_status_response(204);
+  http_headers_set(&ctx->response.headers, SV("Access-Control-Allow-Methods"), options->methods);
+  if (options->headers.length > 0) {
+    http_headers_set(&ctx->response.headers, SV("Access-Control-Allow-Headers"), options->headers);
+  }
+  if (options->max_age > 0) {
+    http_headers_set(&ctx->response.headers, SV("Access-Control-Max-Age"), tprintf("%ld", options->max_age));
+  }
+  return false;
+}
+
+void http_cors_after(HttpContext *ctx, void *data, HttpMiddlewareLocal *local) {
+  const HttpCorsOptions *options = data;
+  if (http_request_known_header(ctx->request, HTTP_HEADER_ORIGIN).length == 0) {
+    return;
+  }
+  http_headers_set(&ctx->response.request_headers, SV("Access-Control-Allow-Origin"), options->origin);
+  if (!sv_equal(options->origin, SV("*"))) {
+    http_headers_set(&ctx->response.request_headers, SV("Vary"), SV("Origin"));
+  }
+}
+
+HttpMiddleware http_middleware_cors(const HttpCorsOptions *options) {
+  assert(options != NULL);
+  return (HttpMiddleware){
+      .name = SV("cors"),
+      .before = http_cors_before,
+      .after = http_cors_after,
+      .data = (void *)options,
+  };
+}
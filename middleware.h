@@ -0,0 +1,78 @@
+#ifndef MIDDLEWARE_H
+#define MIDDLEWARE_H
+
+#include "basic.h"
+#include "http.h"
+#include "router.h"
+
+#define HTTP_MAX_MIDDLEWARE 16
+
+// Per middleware scratch kept for the length of one request, zeroed
+typedef union {
+  long value;
+  void *ptr; // Arena allocated when it needs more room
+} HttpMiddlewareLocal;
+
+// Lives on the stack of http_pipeline_run, one per request, and is copied
+// along with a deferred response
+typedef struct {
+  const HttpRequest *request;
+  HttpResponse response; // Set by the handler or by a short circuiting middleware
+  HttpRouteParams params;
+  HttpMiddlewareLocal locals[HTTP_MAX_MIDDLEWARE];
+} HttpContext;
+
+// Returns false to answer with ctx->response without running the rest of
+// the chain or the handler
+typedef bool (*HttpMiddlewareBefore)(HttpContext *ctx, void *data, HttpMiddlewareLocal *local);
+// Sees the response once it is produced, in reverse order of registration.
+// A deferred response is seen once it is complete, on the completing thread
+// with a copy of the context, where an arena allocated local is gone.
+// Headers that depend on the request go in response.request_headers, the
+// response may be cached or shared with other requests.
+typedef void (*HttpMiddlewareAfter)(HttpContext *ctx, void *data, HttpMiddlewareLocal *local);
+
+// Either hook may be NULL, data is shared by every request
+typedef struct {
+  String name;
+  HttpMiddlewareBefore before;
+  HttpMiddlewareAfter after;
+  void *data;
+} HttpMiddleware;
+
+// Middleware run in order around the router. Built once before listening
+// and only read afterwards, so running it takes no locks and allocates
+// nothing. Responses served from the static routes never reach it, nor
+// do the ones from the response cache apart from http_pipeline_decorate.
+typedef struct {
+  HttpMiddleware items[HTTP_MAX_MIDDLEWARE];
+  size_t length;
+  const HttpRouter *router;
+} HttpPipeline;
+
+void http_pipeline_init(HttpPipeline *pipeline, const HttpRouter *router);
+void http_pipeline_use(HttpPipeline *pipeline, HttpMiddleware middleware); // Before listening
+// Runs the before hooks, the matching route and the after hooks of every
+// middleware whose before hook ran, a short circuit included
+HttpResponse http_pipeline_run(const HttpPipeline *pipeline, const HttpRequest *request);
+// The same without the route, keeping only the request_headers, for
+// http_server_decorate. A short circuit can't stop the response.
+void http_pipeline_decorate(const HttpPipeline *pipeline, const HttpRequest *request,
+                            HashTable *request_headers);
+
+typedef struct {
+  String origin;        // Access-Control-Allow-Origin, "*" for any
+  String methods;       // Answered to preflights
+  String headers;       // Answered to preflights, empty for none
+  long max_age;         // Seconds preflights may be cached, 0 to leave out
+} HttpCorsOptions;
+
+// X-Request-Id on every response, the client's own when it sent one
+HttpMiddleware http_middleware_request_id(void);
+// Server-Timing with the time spent in the rest of the chain
+HttpMiddleware http_middleware_timing(void);
+// Answers preflights and allows origin on everything else, options must
+// outlive the pipeline
+HttpMiddleware http_middleware_cors(const HttpCorsOptions *options);
+
+#endif
@@ -0,0 +1,165 @@
+#include "pool.h"
+#include "basic.h"
+#include "http.h"
+#include "router.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
+
+typedef struct {
+  HttpDeferred *deferred;
+  HttpRouteHandler handler;
+  HttpRouteParams params; // Point into the deferred's copy of the request
+  long queued_us;
+} HttpPoolJob;
+
+typedef MPMC_QUEUE(HttpPoolJob) HttpPoolQueue;
+
+// Submitting takes no lock, idle threads sleep on the semaphore counting
+// the queued jobs
+struct HttpPool {
+  String name;
+  int threads;
+  long max_queue;
+  HttpPoolQueue jobs;
+  sem_t ready;
+
+  atomic_long queued;
+  atomic_long running;
+  atomic_long queue_high_water;
+  atomic_ulong completed;
+  atomic_ulong rejected;
+  atomic_ulong wait_us;
+  atomic_ulong run_us;
+};
+
+long http_pool_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void *http_pool_run(void *arg) {
+  HttpPool *pool = arg;
+  Arena arena = {0};
+
+  while (true) {
+    while (sem_wait(&pool->ready) < 0) {
+    }
+    // A job is queued for this thread, though the producer of the cell
+    // due next may still be writing it
+    HttpPoolJob job;
+    bool ok;
+    mpmc_pop(&pool->jobs, &job, &ok);
+    while (!ok) {
+      sched_yield();
+      mpmc_pop(&pool->jobs, &job, &ok);
+    }
+    atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->running, 1, memory_order_relaxed);
+    const long started_us = http_pool_now_us();
+    atomic_fetch_add_explicit(&pool->wait_us, started_us - job.queued_us, memory_order_relaxed);
+
+    // Completed with the arena still current so the response's
+    // allocations are released the way they were made
+    TempMark mark = tmark();
+    Arena *previous = arena_set_current(&arena);
+    HttpResponse response = job.handler(http_deferred_request(job.deferred), &job.params);
+    http_deferred_complete(job.deferred, response);
+    arena_set_current(previous);
+    arena_reset(&arena);
+    trewind(mark);
+
+    atomic_fetch_sub_explicit(&pool->running, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->completed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->run_us, http_pool_now_us() - started_us, memory_order_relaxed);
+  }
+
+  return NULL;
+}
+
+Error http_pool_new(String name, int threads, int max_queue, HttpPool **out) {
+  if (threads <= 0 || max_queue <= 0) {
+    return errorf("pool " SV_Fmt ": threads and max_queue must be positive", SV_Arg(name));
+  }
+
+  HttpPool *pool = calloc(1, sizeof(HttpPool));
+  assert(pool != NULL);
+  pool->name = name;
+  pool->threads = threads;
+  pool->max_queue = max_queue;
+  // Room for every admitted job, see http_pool_submit
+  size_t capacity = 1;
+  while (capacity < (size_t)max_queue)
+    capacity *= 2;
+  mpmc_init(&pool->jobs, capacity);
+  sem_init(&pool->ready, 0, 0);
+
+  for (int i = 0; i < threads; i++) {
+    pthread_t tid;
+    const int rc = pthread_create(&tid, NULL, http_pool_run, pool);
+    if (rc != 0) {
+      return errorf("pool " SV_Fmt ": pthread_create failed: %s", SV_Arg(name), strerror(rc));
+    }
+    pthread_detach(tid);
+  }
+
+  *out = pool;
+  return ErrorNil;
+}
+
+HttpResponse http_pool_submit(HttpPool *pool, HttpRouteHandler handler, const HttpRequest *request,
+                              const HttpRouteParams *params) {
+  // Admitted jobs never outnumber the ring's cells, so a push only fails
+  // while a thread that popped an earlier cell has yet to release it
+  const long queued = atomic_fetch_add_explicit(&pool->queued, 1, memory_order_relaxed);
+  if (queued >= pool->max_queue) {
+    atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->rejected, 1, memory_order_relaxed);
+    return http_overloaded_status();
+  }
+  long high_water = atomic_load_explicit(&pool->queue_high_water, memory_order_relaxed);
+  while (queued + 1 > high_water &&
+         !atomic_compare_exchange_weak_explicit(&pool->queue_high_water, &high_water, queued + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+  }
+
+  HttpPoolJob job;
+  HttpResponse response = http_defer(request, &job.deferred);
+  job.handler = handler;
+  job.queued_us = http_pool_now_us();
+
+  // Params move along with the path they point into
+  const HttpRequest *copy = http_deferred_request(job.deferred);
+  job.params.length = params->length;
+  for (size_t i = 0; i < params->length; i++) {
+    const String value = params->items[i].value;
+    job.params.items[i].name = params->items[i].name;
+    job.params.items[i].value = SV2(copy->path.items + (value.items - request->path.items), value.length);
+  }
+
+  bool ok;
+  mpmc_push(&pool->jobs, job, &ok);
+  while (!ok) {
+    sched_yield();
+    mpmc_push(&pool->jobs, job, &ok);
+  }
+  sem_post(&pool->ready);
+  return response;
+}
+
+HttpPoolStats http_pool_stats(const HttpPool *pool) {
+  return (HttpPoolStats){
+      .name = pool->name,
+      .threads = pool->threads,
+      .queued = atomic_load_explicit(&pool->queued, memory_order_relaxed),
+      .running = atomic_load_explicit(&pool->running, memory_order_relaxed),
+      .queue_high_water = atomic_load_explicit(&pool->queue_high_water, memory_order_relaxed),
+      .completed = atomic_load_explicit(&pool->completed, memory_order_relaxed),
+      .rejected = atomic_load_explicit(&pool->rejected, memory_order_relaxed),
+      .wait_us = atomic_load_explicit(&pool->wait_us, memory_order_relaxed),
+      .run_us = atomic_load_explicit(&pool->run_us, memory_order_relaxed),
+  };
+}
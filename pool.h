@@ -0,0 +1,34 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "basic.h"
+#include "http.h"
+#include "router.h"
+
+// Bulkhead for expensive routes: a named set of threads with a bounded
+// queue of its own. Requests routed to a pool are deferred off the I/O
+// worker and answered 503 with Retry-After once the queue is full, so a
+// spike on one route can't starve the others.
+typedef struct HttpPool HttpPool;
+
+typedef struct {
+  String name;
+  int threads;
+  long queued;             // Waiting right now
+  long running;            // Being handled right now
+  long queue_high_water;   // Most ever waiting at once
+  unsigned long completed;
+  unsigned long rejected;  // Answered 503 with the queue full
+  unsigned long wait_us;   // Summed time spent queued
+  unsigned long run_us;    // Summed time spent in handlers
+} HttpPoolStats;
+
+// Started right away and kept for the life of the process. Handlers run
+// with a per thread arena and get a copy of the request, see http_defer.
+Error http_pool_new(String name, int threads, int max_queue, HttpPool **out); // Before listening
+// Defers the request to the pool, called on the I/O worker by the router
+HttpResponse http_pool_submit(HttpPool *pool, HttpRouteHandler handler, const HttpRequest *request,
+                              const HttpRouteParams *params);
+HttpPoolStats http_pool_stats(const HttpPool *pool);
+
+#endif
@@ -0,0 +1,321 @@
+#include "router.h"
+#include "basic.h"
+#include "http.h"
+#include "pool.h"
+
+typedef enum {
+  HTTP_ROUTE_STATIC,
+  HTTP_ROUTE_PARAM,
+  HTTP_ROUTE_WILDCARD,
+} HttpRouteKind;
+
+typedef ARRAY(HttpRouteNode *) HttpRouteNodes;
+
+struct HttpRouteNode {
+  HttpRouteKind kind;
+  String prefix;           // Static bytes, or the name of a param or wildcard
+  HttpRouteNodes children; // Static, each starting with a different byte
+  HttpRouteNode *param;
+  HttpRouteNode *wildcard;
+  HttpRouteHandler handlers[HTTP_METHOD_COUNT];
+  HttpPool *pools[HTTP_METHOD_COUNT]; // NULL to run on the I/O worker
+  unsigned allowed; // Bit per method with a handler
+};
+
+const String http_method_names[HTTP_METHOD_COUNT] = {
+  [HTTP_METHOD_GET] = SV("GET"),
+  [HTTP_METHOD_HEAD] = SV("HEAD"),
+  [HTTP_METHOD_POST] = SV("POST"),
+  [HTTP_METHOD_PUT] = SV("PUT"),
+  [HTTP_METHOD_DELETE] = SV("DELETE"),
+  [HTTP_METHOD_PATCH] = SV("PATCH"),
+  [HTTP_METHOD_OPTIONS] = SV("OPTIONS"),
+};
+
+HttpMethod http_method(String method) {
+  for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+    if (sv_equal(http_method_names[i], method))
+      return i;
+  }
+  return HTTP_METHOD_UNKNOWN;
+}
+
+String http_method_name(HttpMethod method) {
+  assert(method < HTTP_METHOD_COUNT);
+  return http_method_names[method];
+}
+
+String http_route_param(const HttpRouteParams *params, String name) {
+  for (size_t i = 0; i < params->length; i++) {
+    if (sv_equal(params->items[i].name, name))
+      return params->items[i].value;
+  }
+  return StringNil;
+}
+
+HttpRouteNode *http_route_node_new(HttpRouteKind kind, String prefix) {
+  HttpRouteNode *node = calloc(1, sizeof(HttpRouteNode));
+  assert(node != NULL);
+  node->kind = kind;
+  node->prefix = prefix;
+  return node;
+}
+
+void http_route_node_free(HttpRouteNode *node) {
+  if (node == NULL)
+    return;
+  for (size_t i = 0; i < node->children.length; i++) {
+    http_route_node_free(node->children.items[i]);
+  }
+  array_free(&node->children);
+  http_route_node_free(node->param);
+  http_route_node_free(node->wildcard);
+  free(node);
+}
+
+// Keeps the first length bytes in node, the rest moves to a new child
+// that takes over everything hanging off node
+void http_route_node_split(HttpRouteNode *node, size_t length) {
+  HttpRouteNode *tail = http_route_node_new(HTTP_ROUTE_STATIC,
+                                            SV2(node->prefix.items + length, node->prefix.length - length));
+  tail->children = node->children;
+  tail->param = node->param;
+  tail->wildcard = node->wildcard;
+  memcpy(tail->handlers, node->handlers, sizeof(node->handlers));
+  memcpy(tail->pools, node->pools, sizeof(node->pools));
+  tail->allowed = node->allowed;
+
+  node->prefix.length = length;
+  node->children = (HttpRouteNodes){0};
+  node->param = NULL;
+  node->wildcard = NULL;
+  memset(node->handlers, 0, sizeof(node->handlers));
+  memset(node->pools, 0, sizeof(node->pools));
+  node->allowed = 0;
+  array_append(&node->children, tail);
+}
+
+HttpRouteNode *http_route_node_child(const HttpRouteNode *node, char first) {
+  for (size_t i = 0; i < node->children.length; i++) {
+    if (node->children.items[i]->prefix.items[0] == first)
+      return node->children.items[i];
+  }
+  return NULL;
+}
+
+// Params and wildcards only start a segment, "/a:b" is static
+bool http_route_param_at(String path, size_t i) {
+  return i > 0 && path.items[i - 1] == '/' && (path.items[i] == ':' || path.items[i] == '*');
+}
+
+// Walks path down from the root adding the nodes it lacks, out is the node
+// the path ends at
+Error http_router_insert(HttpRouter *router, String path, HttpRouteNode **out) {
+  if (path.length == 0 || path.items[0] != '/') {
+    return errorf("route " SV_Fmt ": path must start with '/'", SV_Arg(path));
+  }
+  if (router->root == NULL) {
+    router->root = http_route_node_new(HTTP_ROUTE_STATIC, StringNil);
+  }
+
+  HttpRouteNode *node = router->root;
+  size_t i = 0;
+  size_t params = 0;
+  while (i < path.length) {
+    if (http_route_param_at(path, i)) {
+      const bool wildcard = path.items[i] == '*';
+      size_t end = i + 1;
+      while (end < path.length && path.items[end] != '/')
+        end++;
+      const String name = SV2(path.items + i + 1, end - i - 1);
+      if (name.length == 0) {
+        return errorf("route " SV_Fmt ": unnamed parameter", SV_Arg(path));
+      }
+      if (wildcard && end < path.length) {
+        return errorf("route " SV_Fmt ": wildcard must be the last segment", SV_Arg(path));
+      }
+      if (++params > HTTP_ROUTE_MAX_PARAMS) {
+        return errorf("route " SV_Fmt ": more than %d parameters", SV_Arg(path), HTTP_ROUTE_MAX_PARAMS);
+      }
+
+      HttpRouteNode **slot = wildcard ? &node->wildcard : &node->param;
+      if (*slot == NULL) {
+        *slot = http_route_node_new(wildcard ? HTTP_ROUTE_WILDCARD : HTTP_ROUTE_PARAM, name);
+      } else if (!sv_equal((*slot)->prefix, name)) {
+        return errorf("route " SV_Fmt ": %c" SV_Fmt " conflicts with %c" SV_Fmt, SV_Arg(path),
+                      path.items[i], SV_Arg(name), path.items[i], SV_Arg((*slot)->prefix));
+      }
+      node = *slot;
+      i = end;
+      continue;
+    }
+
+    size_t end = i + 1;
+    while (end < path.length && !http_route_param_at(path, end))
+      end++;
+    const String segment = SV2(path.items + i, end - i);
+
+    HttpRouteNode *child = http_route_node_child(node, segment.items[0]);
+    if (child == NULL) {
+      child = http_route_node_new(HTTP_ROUTE_STATIC, segment);
+      array_append(&node->children, child);
+      node = child;
+      i = end;
+      continue;
+    }
+
+    size_t common = 1;
+    while (common < child->prefix.length && common < segment.length &&
+           child->prefix.items[common] == segment.items[common])
+      common++;
+    if (common < child->prefix.length) {
+      http_route_node_split(child, common);
+    }
+    node = child;
+    i += common;
+  }
+
+  *out = node;
+  return ErrorNil;
+}
+
+Error http_router_add(HttpRouter *router, String method, String path, HttpRouteHandler handler) {
+  return http_router_add_pool(router, method, path, handler, NULL);
+}
+
+Error http_router_add_pool(HttpRouter *router, String method, String path, HttpRouteHandler handler,
+                           HttpPool *pool) {
+  assert(router != NULL);
+  assert(handler != NULL);
+
+  const bool any = sv_equal(method, SV("*"));
+  const HttpMethod m = http_method(method);
+  if (!any && m == HTTP_METHOD_UNKNOWN) {
+    return errorf("route " SV_Fmt ": unsupported method " SV_Fmt, SV_Arg(path), SV_Arg(method));
+  }
+
+  HttpRouteNode *node;
+  Error err = http_router_insert(router, path, &node);
+  if (has_error(err)) {
+    return err;
+  }
+
+  for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+    if (!any && i != m)
+      continue;
+    if (node->handlers[i] != NULL) {
+      return errorf("route " SV_Fmt " " SV_Fmt " is already registered",
+                    SV_Arg(http_method_names[i]), SV_Arg(path));
+    }
+    node->handlers[i] = handler;
+    node->pools[i] = pool;
+    node->allowed |= 1u << i;
+  }
+  router->routes++;
+  return ErrorNil;
+}
+
+// Matches rest, the part of the path after node, against the subtree.
+// Captured params are pushed as they are tried and popped on backtracking.
+const HttpRouteNode *http_route_lookup(const HttpRouteNode *node, String rest, HttpRouteParams *params) {
+  if (rest.length == 0) {
+    if (node->allowed != 0)
+      return node;
+    // "/files/*path" also matches "/files/"
+    if (node->wildcard != NULL) {
+      params->items[params->length++] = (HttpRouteParam){node->wildcard->prefix, rest};
+      return node->wildcard;
+    }
+    return NULL;
+  }
+
+  const HttpRouteNode *child = http_route_node_child(node, rest.items[0]);
+  if (child != NULL && child->prefix.length <= rest.length &&
+      memcmp(child->prefix.items, rest.items, child->prefix.length) == 0) {
+    const HttpRouteNode *found = http_route_lookup(
+        child, SV2(rest.items + child->prefix.length, rest.length - child->prefix.length), params);
+    if (found != NULL)
+      return found;
+  }
+
+  if (node->param != NULL && rest.items[0] != '/') {
+    size_t end = 1;
+    while (end < rest.length && rest.items[end] != '/')
+      end++;
+    params->items[params->length++] = (HttpRouteParam){node->param->prefix, SV2(rest.items, end)};
+    const HttpRouteNode *found = http_route_lookup(node->param, SV2(rest.items + end, rest.length - end), params);
+    if (found != NULL)
+      return found;
+    params->length--;
+  }
+
+  if (node->wildcard != NULL) {
+    params->items[params->length++] = (HttpRouteParam){node->wildcard->prefix, rest};
+    return node->wildcard;
+  }
+  return NULL;
+}
+
+HttpRouteHandler http_router_match(const HttpRouter *router, const HttpRequest *request,
+                                   HttpRouteParams *params, unsigned *allowed, HttpPool **pool) {
+  assert(router != NULL);
+  params->length = 0;
+  *allowed = 0;
+  *pool = NULL;
+  if (router->root == NULL) {
+    return NULL;
+  }
+
+  const String path = sv_split_delim(request->path, '?').first;
+  const HttpRouteNode *node = http_route_lookup(router->root, path, params);
+  if (node == NULL) {
+    return NULL;
+  }
+
+  *allowed = node->allowed;
+  HttpMethod method = http_method(request->method);
+  if (method == HTTP_METHOD_HEAD && node->handlers[HTTP_METHOD_HEAD] == NULL) {
+    method = HTTP_METHOD_GET;
+  }
+  if (method >= HTTP_METHOD_COUNT) {
+    return NULL;
+  }
+  *pool = node->pools[method];
+  return node->handlers[method];
+}
+
+HttpResponse http_router_serve(const HttpRouter *router, const HttpRequest *request, HttpRouteParams *params) {
+  unsigned allowed;
+  HttpPool *pool;
+  const HttpRouteHandler handler = http_router_match(router, request, params, &allowed, &pool);
+  if (handler != NULL) {
+    return (pool != NULL) ? http_pool_submit(pool, handler, request, params) : handler(request, params);
+  }
+  if (allowed == 0) {
+    return http_status_response(404);
+  }
+
+  // HEAD is answered by GET handlers and OPTIONS by the router itself
+  if (allowed & (1u << HTTP_METHOD_GET))
+    allowed |= 1u << HTTP_METHOD_HEAD;
+  allowed |= 1u << HTTP_METHOD_OPTIONS;
+
+  const bool options = http_method(request->method) == HTTP_METHOD_OPTIONS;
+  HttpResponse response = http_status_response(options ? 204 : 405);
+  for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+    if (allowed & (1u << i))
+      http_headers_set(&response.headers, SV("Allow"), http_method_names[i]);
+  }
+  return response;
+}
+
+HttpResponse http_router_dispatch(const HttpRouter *router, const HttpRequest *request) {
+  HttpRouteParams params;
+  return http_router_serve(router, request, &params);
+}
+
+void http_router_free(HttpRouter *router) {
+  http_route_node_free(router->root);
+  router->root = NULL;
+  router->routes = 0;
+}
@@ -0,0 +1,69 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "basic.h"
+#include "http.h"
+
+#define HTTP_ROUTE_MAX_PARAMS 16
+
+typedef enum {
+  HTTP_METHOD_GET,
+  HTTP_METHOD_HEAD,
+  HTTP_METHOD_POST,
+  HTTP_METHOD_PUT,
+  HTTP_METHOD_DELETE,
+  HTTP_METHOD_PATCH,
+  HTTP_METHOD_OPTIONS,
+  HTTP_METHOD_COUNT,
+  HTTP_METHOD_UNKNOWN = HTTP_METHOD_COUNT,
+} HttpMethod;
+
+// Name without its ':' or '*', value points into the request path
+typedef struct {
+  String name;
+  String value;
+} HttpRouteParam;
+
+typedef struct {
+  size_t length;
+  HttpRouteParam items[HTTP_ROUTE_MAX_PARAMS];
+} HttpRouteParams;
+
+typedef HttpResponse (*HttpRouteHandler)(const HttpRequest *request, const HttpRouteParams *params);
+
+typedef struct HttpRouteNode HttpRouteNode;
+typedef struct HttpPool HttpPool;
+
+// Compressed radix tree over the registered paths. Segments are static,
+// ":name" matching one non-empty segment or "*name" matching the rest of
+// the path. Static segments win over params and params over wildcards, a
+// lookup backtracks only when a more specific branch dead ends.
+typedef struct {
+  HttpRouteNode *root;
+  size_t routes;
+} HttpRouter;
+
+HttpMethod http_method(String method);
+String http_method_name(HttpMethod method);
+
+// Paths are not copied and must outlive the router. method is "*" for
+// every method. Conflicting params at the same position are an error.
+Error http_router_add(HttpRouter *router, String method, String path, HttpRouteHandler handler); // Before listening
+// Same, with the handler run on pool instead of the I/O worker, see pool.h
+Error http_router_add_pool(HttpRouter *router, String method, String path, HttpRouteHandler handler,
+                           HttpPool *pool); // Before listening
+// Handler for the request or NULL, allowed is set to the methods the path
+// has handlers for when it matched at all and pool to where it runs
+HttpRouteHandler http_router_match(const HttpRouter *router, const HttpRequest *request,
+                                   HttpRouteParams *params, unsigned *allowed, HttpPool **pool);
+// Runs the matching handler, 404 for unknown paths and 405 with Allow for
+// known paths without a handler for the method. HEAD falls back to GET
+// and OPTIONS is answered with Allow unless it has a handler of its own.
+HttpResponse http_router_dispatch(const HttpRouter *router, const HttpRequest *request);
+HttpResponse http_router_serve(const HttpRouter *router, const HttpRequest *request,
+                               HttpRouteParams *params); // Same, keeping the captured params
+void http_router_free(HttpRouter *router);
+
+String http_route_param(const HttpRouteParams *params, String name); // StringNil when absent
+
+#endif
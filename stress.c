@@ -0,0 +1,175 @@
+// Stress test and throughput benchmark for MPMC_QUEUE and WSDEQUE, run by
+// `make stress`. Every item pushed must come out exactly once.
+#include "basic.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define STRESS_ITEMS (1L << 22)
+#define STRESS_CAPACITY 1024
+#define STRESS_PRODUCERS 4
+#define STRESS_CONSUMERS 4
+#define STRESS_THIEVES 3
+
+typedef MPMC_QUEUE(size_t) StressQueue;
+typedef WSDEQUE(size_t) StressDeque;
+
+// Counts how often each item came out, items are 1..STRESS_ITEMS
+atomic_uchar *stress_seen;
+atomic_long stress_taken;
+
+double stress_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stress_take(size_t item) {
+  assert(item >= 1 && item <= STRESS_ITEMS);
+  atomic_fetch_add_explicit(&stress_seen[item - 1], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stress_taken, 1, memory_order_relaxed);
+}
+
+void stress_reset(void) {
+  for (long i = 0; i < STRESS_ITEMS; i++)
+    atomic_store_explicit(&stress_seen[i], 0, memory_order_relaxed);
+  atomic_store(&stress_taken, 0);
+}
+
+bool stress_check(const char *name, double seconds) {
+  long missing = 0;
+  long duplicated = 0;
+  for (long i = 0; i < STRESS_ITEMS; i++) {
+    const unsigned char seen = atomic_load_explicit(&stress_seen[i], memory_order_relaxed);
+    missing += seen == 0;
+    duplicated += seen > 1;
+  }
+  printf("%-8s %ld items in %.3fs, %.1f M items/s\n", name, STRESS_ITEMS, seconds,
+         STRESS_ITEMS / seconds / 1e6);
+  if (missing > 0 || duplicated > 0) {
+    ERROR("%s: %ld items missing, %ld duplicated", name, missing, duplicated);
+    return false;
+  }
+  return true;
+}
+
+StressQueue stress_queue;
+
+void *stress_produce(void *arg) {
+  const size_t first = (size_t)arg;
+  for (size_t item = first; item <= STRESS_ITEMS; item += STRESS_PRODUCERS) {
+    bool ok;
+    mpmc_push(&stress_queue, item, &ok);
+    while (!ok) {
+      sched_yield();
+      mpmc_push(&stress_queue, item, &ok);
+    }
+  }
+  return NULL;
+}
+
+void *stress_consume(void *arg) {
+  while (atomic_load_explicit(&stress_taken, memory_order_relaxed) < STRESS_ITEMS) {
+    size_t item;
+    bool ok;
+    mpmc_pop(&stress_queue, &item, &ok);
+    if (ok)
+      stress_take(item);
+    else
+      sched_yield();
+  }
+  return NULL;
+}
+
+bool stress_mpmc(void) {
+  pthread_t producers[STRESS_PRODUCERS];
+  pthread_t consumers[STRESS_CONSUMERS];
+  mpmc_init(&stress_queue, STRESS_CAPACITY);
+  stress_reset();
+
+  const double start = stress_now();
+  for (size_t i = 0; i < STRESS_CONSUMERS; i++)
+    pthread_create(&consumers[i], NULL, stress_consume, NULL);
+  for (size_t i = 0; i < STRESS_PRODUCERS; i++)
+    pthread_create(&producers[i], NULL, stress_produce, (void *)(i + 1));
+  for (size_t i = 0; i < STRESS_PRODUCERS; i++)
+    pthread_join(producers[i], NULL);
+  for (size_t i = 0; i < STRESS_CONSUMERS; i++)
+    pthread_join(consumers[i], NULL);
+  const double seconds = stress_now() - start;
+
+  mpmc_free(&stress_queue);
+  return stress_check("mpmc", seconds);
+}
+
+StressDeque stress_deque;
+
+void *stress_steal(void *arg) {
+  while (atomic_load_explicit(&stress_taken, memory_order_relaxed) < STRESS_ITEMS) {
+    size_t item;
+    bool ok;
+    wsdeque_steal(&stress_deque, &item, &ok);
+    if (ok)
+      stress_take(item);
+  }
+  return NULL;
+}
+
+// The owner pushes in bursts and pops part of each back, so both ends
+// race over the last item often
+bool stress_wsdeque(void) {
+  pthread_t thieves[STRESS_THIEVES];
+  wsdeque_init(&stress_deque, STRESS_CAPACITY);
+  stress_reset();
+
+  const double start = stress_now();
+  for (size_t i = 0; i < STRESS_THIEVES; i++)
+    pthread_create(&thieves[i], NULL, stress_steal, NULL);
+  size_t next = 1;
+  while (next <= STRESS_ITEMS) {
+    const size_t burst = 1 + next % 7;
+    for (size_t i = 0; i < burst && next <= STRESS_ITEMS; i++) {
+      bool ok;
+      wsdeque_push(&stress_deque, next, &ok);
+      if (!ok)
+        break;
+      next++;
+    }
+    for (size_t i = 0; i < burst / 2; i++) {
+      size_t item = 0;
+      bool ok;
+      wsdeque_pop(&stress_deque, &item, &ok);
+      if (!ok) {
+        assert(item == 0);
+        break;
+      }
+      stress_take(item);
+    }
+  }
+  while (true) {
+    size_t item;
+    bool ok;
+    wsdeque_pop(&stress_deque, &item, &ok);
+    if (!ok)
+      break;
+    stress_take(item);
+  }
+  for (size_t i = 0; i < STRESS_THIEVES; i++)
+    pthread_join(thieves[i], NULL);
+  const double seconds = stress_now() - start;
+
+  wsdeque_free(&stress_deque);
+  return stress_check("wsdeque", seconds);
+}
+
+int main(void) {
+  stress_seen = malloc(STRESS_ITEMS * sizeof(*stress_seen));
+  assert(stress_seen != NULL);
+
+  bool ok = stress_mpmc();
+  ok = stress_wsdeque() && ok;
+
+  free(stress_seen);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+#include "uring.h"
+#include "basic.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Error uring_init(Uring *ring, unsigned entries) {
+  assert(ring != NULL);
+  *ring = (Uring){0};
+
+  struct io_uring_params p = {0};
+  ring->ring_fd = uring_setup(entries, &p);
+  if (ring->ring_fd < 0) {
+    return errorf("io_uring_setup failed: %s", strerror(errno));
+  }
+  ring->features = p.features;
+
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size)
+      ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    close(ring->ring_fd);
+    return errorf("io_uring mmap failed: %s", strerror(errno));
+  }
+
+  if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  } else {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      munmap(ring->sq_ptr, ring->sq_size);
+      close(ring->ring_fd);
+      return errorf("io_uring mmap failed: %s", strerror(errno));
+    }
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    uring_free(ring);
+    return errorf("io_uring mmap failed: %s", strerror(errno));
+  }
+
+  char *sq = ring->sq_ptr;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+
+  // sqes are always used in ring order so the index array is the identity
+  unsigned *sq_array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) {
+    sq_array[i] = i;
+  }
+
+  char *cq = ring->cq_ptr;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return ErrorNil;
+}
+
+void uring_free(Uring *ring) {
+  assert(ring != NULL);
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr != NULL)
+    munmap(ring->sq_ptr, ring->sq_size);
+  close(ring->ring_fd);
+  *ring = (Uring){0};
+}
+
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr) {
+  const unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  const unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    const int n = uring_enter(ring->ring_fd, to_submit, wait_nr, flags);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return n;
+  }
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    uring_submit_and_wait(ring, 0);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+  const unsigned head = *ring->cq_head;
+  const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+Error uring_buf_ring_init(Uring *ring, UringBufRing *buf_ring, unsigned entries,
+                          size_t buffer_size, unsigned short bgid) {
+  assert((entries & (entries - 1)) == 0 && "entries must be a power of two");
+  *buf_ring = (UringBufRing){0};
+
+  buf_ring->br_size = entries * sizeof(struct io_uring_buf);
+  buf_ring->br = mmap(NULL, buf_ring->br_size, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (buf_ring->br == MAP_FAILED) {
+    return errorf("buffer ring mmap failed: %s", strerror(errno));
+  }
+
+  struct io_uring_buf_reg reg = {0};
+  reg.ring_addr = (unsigned long)buf_ring->br;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+  if (uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(buf_ring->br, buf_ring->br_size);
+    return errorf("IORING_REGISTER_PBUF_RING failed: %s", strerror(errno));
+  }
+
+  buf_ring->buffers = malloc(entries * buffer_size);
+  assert(buf_ring->buffers != NULL);
+  buf_ring->buffer_size = buffer_size;
+  buf_ring->entries = entries;
+  buf_ring->bgid = bgid;
+
+  for (unsigned i = 0; i < entries; i++) {
+    uring_buf_ring_recycle(buf_ring, i);
+  }
+  return ErrorNil;
+}
+
+char *uring_buf_ring_get(const UringBufRing *buf_ring, unsigned short bid) {
+  assert(bid < buf_ring->entries);
+  return buf_ring->buffers + bid * buf_ring->buffer_size;
+}
+
+// Hands the buffer back to the kernel
+void uring_buf_ring_recycle(UringBufRing *buf_ring, unsigned short bid) {
+  const unsigned short tail = buf_ring->br->tail;
+  struct io_uring_buf *buf = &buf_ring->br->bufs[tail & (buf_ring->entries - 1)];
+  buf->addr = (unsigned long)uring_buf_ring_get(buf_ring, bid);
+  buf->len = buf_ring->buffer_size;
+  buf->bid = bid;
+  __atomic_store_n(&buf_ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void uring_buf_ring_free(Uring *ring, UringBufRing *buf_ring) {
+  struct io_uring_buf_reg reg = {0};
+  reg.bgid = buf_ring->bgid;
+  uring_register(ring->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(buf_ring->br, buf_ring->br_size);
+  free(buf_ring->buffers);
+  *buf_ring = (UringBufRing){0};
+}
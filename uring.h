@@ -0,0 +1,58 @@
+#ifndef URING_H
+#define URING_H
+
+#include "basic.h"
+
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper over the raw syscalls (no liburing dependency)
+typedef struct {
+  int ring_fd;
+  unsigned features;
+
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sqe_tail; // Next sqe handed out, ahead of *sq_tail until submit
+  struct io_uring_sqe *sqes;
+
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  size_t sqes_size;
+} Uring;
+
+// Provided buffer ring, the kernel picks a buffer when a recv completes
+typedef struct {
+  struct io_uring_buf_ring *br;
+  size_t br_size;
+  char *buffers;
+  size_t buffer_size;
+  unsigned entries;
+  unsigned short bgid;
+} UringBufRing;
+
+Error uring_init(Uring *ring, unsigned entries);
+void uring_free(Uring *ring);
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring); // Submits when the queue is full
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+
+Error uring_buf_ring_init(Uring *ring, UringBufRing *buf_ring, unsigned entries,
+                          size_t buffer_size, unsigned short bgid);
+char *uring_buf_ring_get(const UringBufRing *buf_ring, unsigned short bid);
+void uring_buf_ring_recycle(UringBufRing *buf_ring, unsigned short bid);
+void uring_buf_ring_free(Uring *ring, UringBufRing *buf_ring);
+
+#endif